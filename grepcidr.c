@@ -23,6 +23,9 @@
 
 
 #define _WITH_GETLINE /* hint for FreeBSD */
+#ifdef __linux__
+#define _GNU_SOURCE	/* for splice() and copy_file_range() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,18 +35,126 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #define EXIT_OK		0
 #define EXIT_NOMATCH	1
 #define EXIT_ERROR	2
 
-#define TXT_VERSION	"grepcidr 2.991\nParts copyright (C) 2004, 2005  Jem E. Berkes <jberkes@pc-tools.net>\n"
+#define TXT_VERSION	"grepcidr 2.992\nParts copyright (C) 2004, 2005  Jem E. Berkes <jberkes@pc-tools.net>\n"
 #define TXT_USAGE	"Usage:\n" \
-			"\tgrepcidr [-V] [-cCDvhais] PATTERN [FILE...]\n" \
-			"\tgrepcidr [-V] [-cCDvhais] [-e PATTERN | -f FILE] [FILE...]\n"
+			"\tgrepcidr [-V] [-cCDvhairslLnb] [-j NUM] [-m NUM] [--quiet] PATTERN [FILE...]\n" \
+			"\tgrepcidr [-V] [-cCDvhairslLnb] [-j NUM] [-m NUM] [--quiet] [-e PATTERN | -f FILE] [FILE...]\n" \
+			"Long options, see grepcidr(1):\n" \
+			"\tinput:    --follow --checkpoint FILE --shard I/N --blocks NUM\n" \
+			"\t          --index --use-index --pcap --write-pcap FILE\n" \
+			"\t          --binary-input 4|6 --record-size N --record-offset N --text-output\n" \
+			"\toutput:   --count-addresses --top K --by-prefix LEN --by-prefix6 LEN\n" \
+			"\t          --rewrite --rewrite-prefix V4LEN/V6LEN --rewrite-key FILE\n" \
+			"\t          --json --profile\n" \
+			"\tpatterns: --aggregate --intersect FILE --subtract FILE\n" \
+			"\t          --memory SIZE --external\n" \
+			"\t          --compile STORE --store STORE --apply-delta FILE\n"
 #define MAXFIELD	512
 #define TOKEN_SEPS	"\t,\r\n"	/* so user can specify multiple patterns on command line */
 #define INIT_NETWORKS	8192
+#define OBUF_INIT	65536		/* initial per-file output buffer */
+#define JOBS_AHEAD	4		/* files in flight per worker thread */
+#define PIPE_BLOCK	(1024*1024)	/* bytes of standard input per block */
+#define FOLLOW_CHUNK	(1<<20)		/* read growing files this much at a time */
+#define FOLLOW_POLL	1000		/* msec between checks without an event */
+#define CKPT_FPLEN	4096		/* checkpoint fingerprints this much of a file */
+#define BIN_BATCH	1024		/* binary records matched at a time */
+#define REC_MAX		65536		/* largest --record-size and --record-offset */
+#define TALLY_INIT	4096		/* initial --count-addresses table slots */
+#ifndef COVER_MIN
+#define COVER_MIN	128		/* v4 ranges needed to use the /24 cover map */
+#endif
+/* scanner flags, see pick_scanner() */
+#define SF_V4		1		/* have v4 patterns */
+#define SF_V6		2		/* have v6 patterns */
+#define SF_ANCHOR	4		/* -a */
+#define SF_INVERT	8		/* -v */
+#define SF_COUNT	16		/* -c, or anything else not printing lines */
+#define SF_QUICK	32		/* -q */
+#define SF_CIDR		64		/* -C or -D */
+#define SF_INDEX	128		/* --index, note every address */
+#define SF_TALLY	256		/* --count-addresses */
+#define SF_REWRITE	512		/* --rewrite */
+#define SF_JSON		1024		/* --json */
+#define SF_EACH		(SF_TALLY|SF_REWRITE|SF_JSON)	/* act on each address */
+
+/* character classes in sclass[] */
+#define C_START		1		/* might start an IP, or end a line */
+#define C_DOT		2		/* might start an IP with -q */
+#define C_DIGIT		4		/* 0-9 */
+#define C_XDIGIT	8		/* 0-9 a-f A-F */
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE	inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE	inline
+#endif
+
+/* long options with no short form */
+#define OPT_QUIET	256
+#define OPT_FOLLOW	257
+#define OPT_CHECKPOINT	258
+#define OPT_INDEX	259
+#define OPT_USEINDEX	260
+#define OPT_BININPUT	261
+#define OPT_RECSIZE	262
+#define OPT_RECOFF	263
+#define OPT_TEXTOUT	264
+#define OPT_PCAP	265
+#define OPT_WRITEPCAP	266
+#define OPT_MEMORY	267
+#define OPT_EXTERNAL	268
+#define OPT_COUNTADDR	269
+#define OPT_TOP		270
+#define OPT_BYPREFIX	271
+#define OPT_BYPREFIX6	272
+#define OPT_AGGREGATE	273
+#define OPT_INTERSECT	274
+#define OPT_SUBTRACT	275
+#define OPT_SHARD	276
+#define OPT_REWRITE	277
+#define OPT_RWPREFIX	278
+#define OPT_RWKEY	279
+#define OPT_JSON	280
+#define OPT_PROFILE	281
+#define OPT_COMPILE	282
+#define OPT_STORE	283
+#define OPT_DELTA	284
+#define OPT_BLOCKS	285
+
+#define SMALLSET	64		/* linear search for this many ranges or fewer */
+#define PAGE6		32		/* ranges in each page of packed v6 patterns */
+#ifndef PACK6_MIN
+#define PACK6_MIN	16384		/* pack v6 patterns when there are this many */
+#endif
+#define PACK6_CHUNK	(64*PACK6_MIN)	/* while loading, pack them away this many at a time */
+#ifndef MAPWINDOW
+#define MAPWINDOW	((size_t)1<<30)	/* map big files this much at a time */
+#endif
 
 /*
 	Specifies a network. Whether originally in CIDR format (IP/mask)
@@ -74,20 +185,327 @@ static unsigned int capacity = 0;		/* current capacity of array */
 static unsigned int capacity6 = 0;		/* current capacity of v6 array */
 static struct netspec* array = NULL;		/* array of patterns, network specs */
 static struct netspec6* array6 = NULL;		/* array of patterns, v6 network specs */
+static unsigned char *cover24 = NULL;		/* 2 bits per /24, see build_cover() */
+static unsigned char sclass[256];		/* C_xxx for each character */
+static unsigned char xval[256];			/* value of each hex digit */
+static int nsmall4 = 0;				/* entries in small4, 0 if not in use */
+static int nsmall6 = 0;				/* entries in small6 */
+static struct {					/* few patterns, see build_small() */
+	unsigned int min[SMALLSET];
+	unsigned int max[SMALLSET];
+} small4;
+static struct {
+	unsigned long long minhi[SMALLSET], minlo[SMALLSET];
+	unsigned long long maxhi[SMALLSET], maxlo[SMALLSET];
+} small6;
+struct pack6 {					/* packed v6 patterns, see pack6_make() */
+	unsigned int n;			/* ranges */
+	unsigned int npages;
+	v6addr *pmin;			/* first address in each page */
+	size_t *poff;			/* where each page starts in data, and the end */
+	unsigned char *data;
+	v6addr lo, hi;			/* lowest and highest address in any range */
+	unsigned int chunks;		/* loading chunks in it, see run6_add() */
+};
+static struct pack6 packed6;			/* lots of v6 patterns, n is 0 if not in use */
+static struct pack6 *runs6 = NULL;		/* chunks of a big v6 list packed while loading */
+static unsigned int nruns6 = 0;
+static size_t runs6len = 0;			/* bytes in them */
+struct p6iter {					/* a pass through packed or array6 patterns */
+	const struct pack6 *p;		/* NULL for array6[] */
+	unsigned int i;
+	const unsigned char *d;
+	struct netspec6 r;		/* the current one */
+};
 static unsigned int counting = 0;		/* when non-zero, counts matches */
 static int invert = 0;				/* flag for inverted mode */
 static int anchor = 0;				/* anchor matches at beginning of line */
 static int nonames = 0;				/* don't show filenames */
+static int numlines = 0;			/* -n show line numbers */
+static int byteoffs = 0;			/* -b show byte offsets of lines */
 static int nmatch = 0;				/* count of matches for exit code */
 static int igbadpat = 0;			/* ignore bad patterns */
 static int sloppy = 0;				/* don't complain about sloppy CIDR */
 static int cidrsearch = 0;			/* parse and match CIDR in haystack */
 static int didrsearch = 0;			/* match CIDR if overlaps with haystack */
 static int quick = 0;				/* quick match, ignore v4 with dots before or after */
+static int recursive = 0;			/* descend into directories */
+static int nthreads = 0;			/* worker threads, 0 means one per CPU */
+static int listfiles = 0;			/* -l list matching files, -L non-matching */
+static int silent = 0;				/* no output, exit on first match */
+static unsigned int stopafter = ~0U;		/* stop a file after this many matches */
+static int follow = 0;				/* watch files for new lines */
+static char *ckptfile = NULL;			/* --checkpoint file */
+static enum { ZC_NONE, ZC_SENDFILE, ZC_SPLICE, ZC_COPY } zcmode = ZC_NONE;	/* see zc_flush() */
+static int indexing = 0;			/* --index, write an index */
+static int useindex = 0;			/* --use-index, read FILE.gcidx */
+static int binaddr = 0;				/* --binary-input, 4 or 6 */
+static size_t recsize = 0;			/* --record-size */
+static size_t recoff = 0;			/* --record-offset */
+static int bintext = 0;				/* --text-output */
+static int pcapmode = 0;			/* --pcap */
+static const char *pcapfile = NULL;		/* --write-pcap */
+static FILE *pcapout = NULL;			/* and open */
+static int pcaplink = -1;			/* its link type, -1 until it's started */
+
+/* buffered output for one file */
+struct obuf {
+	char *buf;
+	size_t len;		/* bytes in use */
+	size_t size;		/* bytes allocated */
+};
+
+/* state for scanning one file, so several can be scanned at once */
+struct scanfile {
+	const char *fn;		/* filename for printing, NULL for stdin */
+	unsigned int nmatch;	/* matches in this file */
+	struct obuf out;	/* output not yet written */
+	int jobx;		/* index in jobs[], -1 if not in a worker */
+	int stopped;		/* quit early, -m or -l */
+	off_t boff;		/* file offset of the block being scanned */
+	const char *bp;		/* and where it's mapped */
+	int zc;			/* lines can go straight from zfd to stdout */
+	int zfd;
+	off_t zoff;		/* lines not yet written, see zc_flush() */
+	size_t zlen;
+	struct tally *tl;	/* --count-addresses table, NULL for the main one */
+	unsigned long long lineno;	/* newlines before lnoff, see count_lines() */
+	off_t lnoff;
+	struct prof *pf;	/* --profile figures, NULL for the main ones */
+};
+
+/*
+	A file to be scanned by a worker thread. Output is kept
+	until all earlier files are printed, so it comes out in
+	command line order.
+*/
+struct job {
+	const char *fn;
+	struct scanfile sf;
+	int done;		/* scan finished */
+	int err;		/* errno if it couldn't be opened */
+};
+
+static char **files = NULL;			/* files to scan */
+static int nfiles = 0;
+static int capfiles = 0;
+static struct job *jobs = NULL;			/* one per file when threaded */
+static int nextjob = 0;				/* next job to start */
+static int headjob = 0;				/* next job to print */
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+
+/*
+	A block of whole lines from standard input, scanned by a
+	worker thread and printed in order like a job. Blocks are
+	numbered as they're read, and block i uses slot i % npblocks.
+*/
+struct pblock {
+	char *buf;
+	size_t len;		/* bytes of whole lines */
+	size_t size;
+	struct scanfile sf;
+	int done;		/* scan finished */
+};
+
+static struct pblock *pblocks = NULL;
+static int npblocks = 0;			/* --blocks, 0 means JOBS_AHEAD per thread */
+static int nread = 0;				/* blocks read so far */
+static int readeof = 0;				/* and that's all of them */
+
+/*
+	Where the last --checkpoint run got to in a file, found
+	by device and inode, and checked against a hash of the start
+	of the file in case it was replaced and the inode reused.
+*/
+struct ckpt {
+	unsigned long long dev, ino;
+	off_t off;		/* end of the last line scanned */
+	unsigned int fplen;	/* bytes in the fingerprint */
+	unsigned long long fp;	/* hash of the first fplen bytes */
+	char *fn;		/* name, to drop entries for files that are gone */
+	int seen;		/* scanned this time, new values below */
+	off_t newoff;
+	unsigned int newfplen;
+	unsigned long long newfp;
+};
+
+static struct ckpt *ckpts = NULL;
+static int nckpts = 0;
+static int capckpts = 0;
+static int *ckpthash = NULL;			/* ckpts[] index+1 by dev and inode, 0 if free */
+static unsigned int ckpthsize = 0;		/* a power of two */
+static pthread_mutex_t ckptlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* an external sort, see xs_add() */
+struct xsort {
+	size_t rsize;		/* record size */
+	int (*cmp)(const void *, const void *);
+	char *buf;		/* records not yet in a run */
+	size_t n, cap;		/* records in buf, and room for */
+	size_t next;		/* next to read from buf, if no runs */
+	unsigned long long total;	/* records added */
+	FILE **runs;		/* sorted runs on disk */
+	int nruns;
+	char *heads;		/* next record from each run */
+	int *heap;		/* runs ordered by heads */
+	int nheap;
+};
+
+static size_t memlimit = 0;			/* --memory, 0 for half of RAM */
+static int external = 0;			/* patterns didn't fit, see go_external() */
+static struct xsort xpat4, xpat6;		/* patterns, when external */
+static FILE *xpat4f, *xpat6f;			/* and merged, on disk */
+static unsigned long long xn4 = 0, xn6 = 0;	/* merged ranges in them */
+static struct xsort ixs4, ixs6;			/* addresses in a file, see ix_add4() */
+
+/* distinct addresses and their counts, see tally_add() */
+struct tent {
+	v6addr a;		/* v4 in the last four bytes */
+	unsigned char v4;
+	unsigned char used;
+	unsigned int hash;
+	unsigned int pos;	/* place in heap[], once it's a sketch */
+	unsigned long long n;	/* count */
+	unsigned long long err;	/* how much of n might be other addresses */
+};
+
+struct tally {
+	struct tent *t;		/* hash table, a power of two slots */
+	size_t mask;		/* slots - 1 */
+	size_t n;		/* slots in use */
+	size_t budget;		/* bytes it can grow to */
+	unsigned int *heap;	/* slots by count, once it's a sketch */
+};
 
-static void scan_block(char *bp, size_t blen, const char *fn);
-static void scan_read(FILE *f, const char *fn);
+static int tallying = 0;			/* --count-addresses */
+static unsigned long topk = 0;			/* --top, 0 for all */
+static int bypfx4 = 32, bypfx6 = 128;		/* --by-prefix, --by-prefix6 */
+static struct tally tally;			/* main table, others merged in */
+static enum { SETOP_NONE, SETOP_AGGREGATE, SETOP_INTERSECT, SETOP_SUBTRACT } setop = SETOP_NONE;
+static char *setfile = NULL;			/* --intersect or --subtract list */
+static int shard = 0, nshards = 0;		/* --shard I/N */
+static int rewriting = 0;			/* --rewrite */
+static int rw4 = 24, rw6 = 48;			/* --rewrite-prefix */
+static int rwkeyed = 0;				/* --rewrite-key */
+static unsigned long long rwkey[2];
+static int jsonout = 0;				/* --json */
+static char *compfile = NULL;			/* --compile */
+static char *storefile = NULL;			/* --store */
+static char *deltafile = NULL;			/* --apply-delta */
+
+/* --profile figures for one thread, see prof_init() */
+enum { PH_LOAD, PH_SORT, PH_SCAN, PH_LOOKUP, PH_OUTPUT, PH_CAL, NPHASES };
+#define NCTR	4		/* cycles, instructions, branch misses, LLC misses */
+#define NPV	(1+NCTR)	/* and nanoseconds first */
+#define PROF_EVERY	64	/* keep one lookup in this many */
+#define PROF_KEYS	4096	/* and do them again when there are this many */
+#define PROF_BIG	65536	/* time blocks this big alone, else PROF_EVERY together */
+
+struct prof {
+	int nctr;		/* counters open, 0 or NCTR */
+	int err;		/* errno if not */
+#ifdef __linux__
+	int fd[NCTR];
+	struct perf_event_mmap_page *pg[NCTR];	/* for rdpmc */
+#endif
+	int inscan;		/* in scan_block(), output is saved */
+	int run;		/* blocks since runv, see scan_prof() */
+	unsigned long long runv[NPV];
+	int cur;		/* prof_mark() phase, -1 for none */
+	unsigned long long mark[NPV];
+	unsigned long long ovh[NPV];	/* what a reading costs */
+	unsigned long long calls[NPHASES];	/* times through each */
+	double sum[NPHASES][NPV];
+	struct netspec *k4;	/* lookups kept to be done again */
+	struct netspec6 *k6;
+	int nk4, nk6;
+	unsigned long long nl4, nl6;	/* lookups */
+	unsigned long long pend4, pend6;	/* since the last replay */
+	unsigned int sink;	/* so replayed lookups aren't optimized away */
+	unsigned long long bytes;	/* scanned */
+};
+
+static int profiling = 0;			/* --profile */
+static struct prof prof;			/* main thread, workers merged in */
+static int (*scan_inner)(char *bp, size_t blen, struct scanfile *sf);	/* under scan_prof() */
+#define PROF(sf)	((sf)->pf? (sf)->pf: &prof)
+
+static int (*scan_block)(char *bp, size_t blen, struct scanfile *sf);
+static void pick_scanner(void);
+static void scan_read(FILE *f, off_t left, struct scanfile *sf);
+static void file_done(struct scanfile *sf);
+static void out_write(struct scanfile *sf, const char *p, size_t len);
+static void zc_init(void);
+static void zc_flush(struct scanfile *sf);
+static int scan_file(const char *fn, struct scanfile *sf);
+static off_t scan_map(int fd, off_t start, off_t end, struct scanfile *sf);
+static void add_file(const char *fn);
+static void walk_dir(const char *dn);
+static int scan_threaded(void);
+static void scan_pipe(struct scanfile *sf);
+static int follow_files(void);
+static void ckpt_load(void);
+static int ckpt_save(void);
+static off_t ckpt_start(int fd, const struct stat *st);
+static off_t whole_lines(int fd, off_t start, off_t end);
+static void ckpt_done(const char *fn, int fd, const struct stat *st, off_t end);
+static int index_build(const char *fn);
+static FILE *xs_tmpfile(void);
+static void xs_init(struct xsort *xs, size_t rsize, int (*cmp)(const void *, const void *), size_t budget);
+static void xs_add(struct xsort *xs, const void *rec);
+static void xs_finish(struct xsort *xs);
+static int xs_next(struct xsort *xs, void *rec);
+static void xs_free(struct xsort *xs);
+static void go_external(void);
+static void xpat_merge(void);
+static void xjoin(FILE *f, struct scanfile *sf);
+static void scan_binary(int fd, struct scanfile *sf);
+static int bin_block(const unsigned char *buf, size_t nrec, struct scanfile *sf);
+static void scan_pcap(int fd, struct scanfile *sf);
+static void pcap_header(int linktype);
+static void pcap_write(int linktype, long long sec, unsigned int usec,
+	const unsigned char *p, unsigned int caplen, unsigned int origlen);
+static void tally4(struct scanfile *sf, unsigned int addr);
+static void tally6(struct scanfile *sf, const v6addr *addr);
+static void tally_merge(struct tally *from);
+static void tally_print(void);
+static void rewrite_key(const char *fn);
+static char *rewrite4(struct scanfile *sf, char *cp, char *from, char *to, unsigned int addr);
+static char *rewrite6(struct scanfile *sf, char *cp, char *from, char *to, const v6addr *addr);
+static void json_pattern(const char *text, const v6addr *min, const v6addr *max, int v6);
+static void json_pattern4(const char *text, const struct netspec *spec);
+static void json_build(int v6);
+static void count_lines(struct scanfile *sf, const char *upto);
+static unsigned long long lines_before(int fd, off_t end);
+static void json4(struct scanfile *sf, const char *lp, const char *from, const char *to, unsigned int addr);
+static void json6(struct scanfile *sf, const char *lp, const char *from, const char *to, const v6addr *addr);
+static void combine_patterns(void);
+static void merge6(void);
+static void combine6(void);
+static void build_pack6(void);
+static void run6_add(void);
+static void run6_merge(void);
+static void pack6_free(struct pack6 *p);
+static int p6next(struct p6iter *it);
+static void prof_init(struct prof *pf);
+static void prof_merge(struct prof *pf);
+static void prof_replay(struct prof *pf);
+static void prof_mark(int ph);
+static void prof_print(void);
+static int scan_prof(char *bp, size_t blen, struct scanfile *sf);
+static void prof_flush(struct scanfile *sf);
+static int prof_lookup4(struct scanfile *sf, const struct netspec r);
+static int prof_lookup6(struct scanfile *sf, const struct netspec6 r);
+static int fmt4(char *buf, unsigned int a);
+static int fmt6(char *buf, const v6addr *a);
+static int netmatch(const struct netspec ip4);
+static int netmatch6(const struct netspec6 ip6);
+static void netmatch_batch(const unsigned int *a, int n, unsigned char *hit);
+static int index_scan(const char *fn, FILE *f, const struct stat *st, struct scanfile *sf);
 static int applymask6(const v6addr ahi, int size, struct netspec6 *spec);
+static void build_cover(void);
+static void build_small(void);
 
 /* for getline */
 char *linep = NULL;
@@ -99,6 +517,10 @@ size_t linesize;
 */
 void array_insert(struct netspec* newspec)
 {
+	if(external) {
+		xs_add(&xpat4, newspec);
+		return;
+	}
 	/* Initial array allocation */
 	if(!array) {
 		capacity = INIT_NETWORKS;
@@ -110,6 +532,11 @@ void array_insert(struct netspec* newspec)
 	}
 	if (npatterns == capacity)
 	{
+		if(2*capacity*sizeof(struct netspec) + capacity6*sizeof(struct netspec6) + runs6len > memlimit) {
+			go_external();		/* too big, sort on disk */
+			xs_add(&xpat4, newspec);
+			return;
+		}
 		capacity *= 2;
 		array = (struct netspec *)realloc(array, capacity*sizeof(struct netspec));
 		if(!array) {
@@ -122,6 +549,10 @@ void array_insert(struct netspec* newspec)
 
 void array_insert6(struct netspec6* newspec)
 {
+	if(external) {
+		xs_add(&xpat6, newspec);
+		return;
+	}
 	/* Initial array allocation */
 	if(!array6) {
 		capacity6 = INIT_NETWORKS;
@@ -133,11 +564,33 @@ void array_insert6(struct netspec6* newspec)
 	}
 	if (n6patterns == capacity6)
 	{
-		capacity6 *= 2;
-		array6 = (struct netspec6 *)realloc(array6, capacity6*sizeof(struct netspec6));
-		if(!array6) {
-			perror("Out of memory");
-			exit(EXIT_ERROR);
+		int grow = 1;
+
+		/*
+		 * big lists often overlap, merging may make enough room,
+		 * and past a chunk pack them away rather than grow.
+		 * --compile counts duplicates, and the set operations
+		 * want them all in array6[]
+		 */
+		if(capacity6 >= PACK6_MIN && !compfile && !setop) {
+			merge6();
+			if(n6patterns > capacity6 - capacity6/4 && capacity6 >= PACK6_CHUNK)
+				run6_add();
+			grow = (n6patterns > capacity6 - capacity6/4);
+		}
+		if(capacity*sizeof(struct netspec) + (1+grow)*capacity6*sizeof(struct netspec6)
+				+ runs6len > memlimit) {
+			go_external();
+			xs_add(&xpat6, newspec);
+			return;
+		}
+		if(grow) {
+			capacity6 *= 2;
+			array6 = (struct netspec6 *)realloc(array6, capacity6*sizeof(struct netspec6));
+			if(!array6) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
 		}
 	}
 	array6[n6patterns++] = *newspec;
@@ -618,91 +1071,56 @@ int netsort6(const void* a, const void* b)
 	return v6cmp(*c1, *c2);
 }
 
-int main(int argc, char* argv[])
+/* format an address as text, return the length */
+static int fmt4(char *buf, unsigned int a)
 {
-	static char shortopts[] = "acCDe:f:iqsvV";
-	char* pat_filename = NULL;		/* filename containing patterns */
-	char* pat_strings = NULL;		/* pattern strings on command line */
-	int foundopt;
-
-	if (argc == 1)
-	{
-		fprintf(stderr, TXT_USAGE);
-		return EXIT_ERROR;
-	}
-
-	while ((foundopt = getopt(argc, argv, shortopts)) != -1)
-	{
-		switch (foundopt)
-		{
-			case 'V':
-				puts(TXT_VERSION);
-				return EXIT_ERROR;
-				
-			case 'c':
-				counting = 1;
-				break;
-				
-			case 'v':
-				invert = 1;
-				break;
-				
-			case 'h':
-				nonames = 1;
-				break;
-
-			case 'a':
-				anchor = 1;
-				break;
-
-			case 'i':
-				igbadpat = 1;
-				break;
-
-			case 'q':
-				quick = 1;
-				break;
-
-			case 's':
-				sloppy = 1;
-				break;
-
-			case 'D':
-				didrsearch = 1;
-				/* fall through */
+	return sprintf(buf, "%u.%u.%u.%u", a>>24, (a>>16)&255, (a>>8)&255, a&255);
+}
 
-			case 'C':
-				cidrsearch = 1;
-				break;
+/*
+ * in the RFC 5952 form: lower case, no leading zeros, the
+ * longest run of two or more zero chunks as ::, and IPv4 mapped
+ * addresses with the v4 part dotted
+ */
+static int fmt6(char *buf, const v6addr *a)
+{
+	static const unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,255,255 };
+	unsigned int ch[8];
+	int i, zx = -1, zlen = 1, len = 0;
 
-			case 'e':
-				pat_strings = optarg;
-				break;
+	if(memcmp(a->a, mapped, 12) == 0)
+		return sprintf(buf, "::ffff:%u.%u.%u.%u", a->a[12], a->a[13], a->a[14], a->a[15]);
+	for(i = 0; i < 8; i++)
+		ch[i] = a->a[2*i]<<8 | a->a[2*i+1];
+	for(i = 0; i < 8; i++) {	/* find the longest zero run */
+		int j = i;
 
-			case 'f':
-				pat_filename = optarg;
-				break;
-				
-			default:
-				fprintf(stderr, TXT_USAGE);
-				return EXIT_ERROR;
+		while(j < 8 && ch[j] == 0)
+			j++;
+		if(j-i > zlen) {
+			zx = i;
+			zlen = j-i;
 		}
+		if(j > i)
+			i = j-1;
 	}
-	if (!pat_filename && !pat_strings)
-	{
-		if (optind < argc)
-			pat_strings = argv[optind++];
-		else
-		{
-			fprintf(stderr, "Specify PATTERN or -f FILE to read patterns from\n");
-			return EXIT_ERROR;
+	for(i = 0; i < 8; i++) {
+		if(i == zx) {
+			len += sprintf(buf+len, "::");
+			i += zlen-1;
+			continue;
 		}
+		len += sprintf(buf+len, (i && i != zx+zlen)? ":%x": "%x", ch[i]);
 	}
-	
-	/* Load patterns defining networks */
-	if (pat_filename)
+	return len;
+}
+
+/* load patterns from a file and/or a string of them */
+static void load_patterns(const char *fn, char *strs)
+{
+	if (fn)
 	{
-		FILE* data = fopen(pat_filename, "r");
+		FILE* data = fopen(fn, "r");
 		if (data)
 		{
 			while (getline(&linep, &linesize, data) > 0)
@@ -711,15 +1129,21 @@ int main(int argc, char* argv[])
 					if(strchr(linep, ':')) {
 						struct netspec6 spec6;
 
-						if(net_parse6(linep, &spec6))
+						if(net_parse6(linep, &spec6)) {
 							array_insert6(&spec6);
+							if(jsonout)
+								json_pattern(linep, &spec6.min, &spec6.max, 1);
+						}
 						else if(!igbadpat)
 							fprintf(stderr, "Not a pattern: %s", linep);
 					} else {
 						struct netspec spec;
 
-						if (net_parse(linep, &spec))
+						if (net_parse(linep, &spec)) {
 							array_insert(&spec);
+							if(jsonout)
+								json_pattern4(linep, &spec);
+						}
 						else if(!igbadpat)
 							fprintf(stderr, "Not a pattern: %s", linep);
 					}
@@ -729,42 +1153,48 @@ int main(int argc, char* argv[])
 		}
 		else
 		{
-			perror(pat_filename);
-			return EXIT_ERROR;
+			perror(fn);
+			exit(EXIT_ERROR);
 		}
 	}
-	if (pat_strings)
+	if (strs)
 	{
-		char* token = strtok(pat_strings, TOKEN_SEPS);
+		char* token = strtok(strs, TOKEN_SEPS);
 		while (token)
 		{
 			if(strchr(token, ':')) {
 				struct netspec6 spec6;
 
-				if(net_parse6(token, &spec6))
+				if(net_parse6(token, &spec6)) {
 					array_insert6(&spec6);
+					if(jsonout)
+						json_pattern(token, &spec6.min, &spec6.max, 1);
+				}
 				else if(!igbadpat)
 					fprintf(stderr, "Not a pattern: %s\n", token);
 			} else {
 				struct netspec spec;
 
-				if (net_parse(token, &spec))
+				if (net_parse(token, &spec)) {
 					array_insert(&spec);
+					if(jsonout)
+						json_pattern4(token, &spec);
+				}
 				else if(!igbadpat)
 					fprintf(stderr, "Not a pattern: %s\n", token);
 			}
 			token = strtok(NULL, TOKEN_SEPS);
 		}
 	}
-	
-	if(!npatterns && !n6patterns) {
-		fprintf(stderr, "No patterns to match\n");
-		return EXIT_ERROR;
-	}
+}
 
-	/* Prepare array for rapid searching */
+/*
+ * Prepare array for rapid searching, sorted with overlapping
+ * ranges combined
+ */
+static void merge_patterns(void)
+{
 	if(npatterns) {
-		struct netspec *inp, *outp;
 #if DEBUG
 		char *dnp;
 		if((dnp = getenv("PRESORT4")) != 0) {
@@ -789,6 +1219,34 @@ int main(int argc, char* argv[])
 			fclose(f);
 		}
 #endif /* DEBUG */		
+	}
+	if(n6patterns)
+		qsort(array6, n6patterns, sizeof(struct netspec6), netsort6);
+	combine_patterns();
+	if(nruns6) {	/* a big list packed while loading, put it together */
+		if(n6patterns)
+			run6_add();
+		while(nruns6 > 1)
+			run6_merge();
+		packed6 = runs6[0];
+		free(runs6);
+		free(array6);
+		runs6 = NULL;
+		array6 = NULL;
+		nruns6 = capacity6 = 0;
+		runs6len = 0;
+		n6patterns = packed6.n;
+	}
+}
+
+/* combine overlapping ranges in the sorted arrays */
+static void combine_patterns(void)
+{
+	if(npatterns) {
+		struct netspec *inp, *outp;
+#if DEBUG
+		char *dnp;
+#endif
 
 		/* combine overlapping ranges
 		 * outp is clean so far, inp is checked for overlap
@@ -819,11 +1277,22 @@ int main(int argc, char* argv[])
 		}
 #endif /* DEBUG */		
 	}
+	combine6();
+}
+
+/* sort and combine the v6 patterns, also while loading a big list */
+static void merge6(void)
+{
+	qsort(array6, n6patterns, sizeof(struct netspec6), netsort6);
+	combine6();
+}
+
+/* combine overlapping v6 ranges in the sorted array6 */
+static void combine6(void)
+{
 	if(n6patterns) {
 		struct netspec6 *inp, *outp;
 
-		qsort(array6, n6patterns, sizeof(struct netspec6), netsort6);
-
 		/* combine overlapping ranges
 		 * outp is clean so far, inp is checked for overlap
 		 */
@@ -842,91 +1311,4771 @@ int main(int argc, char* argv[])
 		}
 		n6patterns = outp-array6+1;		/* adjusted count after combinations */
 	}
+}
 
-# if DEBUG
-	{	/* DEBUG */
-		int i,n;
-		for(n = 0; n < n6patterns; n++) {
-			printf("min %d:", n);
-			for(i = 0; i<16; i++) printf(" %02x", array6[n].min.a[i]);
-			printf("\nmax %d:",n);
-			for(i = 0; i<16; i++) printf(" %02x", array6[n].max.a[i]);
-			printf("\n");
+/* add one to a v6 address */
+static void v6inc(v6addr *a)
+{
+	int i;
+
+	for(i = 15; i >= 0; i--)
+		if(++a->a[i])
+			break;
+}
+
+/* subtract one */
+static void v6dec(v6addr *a)
+{
+	int i;
+
+	for(i = 15; i >= 0; i--)
+		if(a->a[i]--)
+			break;
+}
+
+/*
+ * --aggregate, --intersect, and --subtract print the merged patterns,
+ * or their intersection with or difference from another list, as the
+ * fewest CIDR blocks covering exactly those addresses.
+ * v4 ranges are done as v6 ranges in the low 32 bits, so the same
+ * code handles both.
+ */
+static struct netspec6 *set_to6(const struct netspec *a, size_t n)
+{
+	struct netspec6 *r = calloc(n+1, sizeof(struct netspec6));
+	size_t i;
+	int b;
+
+	if(!r) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < n; i++)
+		for(b = 0; b < 4; b++) {
+			r[i].min.a[12+b] = a[i].min >> (24-8*b);
+			r[i].max.a[12+b] = a[i].max >> (24-8*b);
 		}
+	return r;
+}
+
+/*
+ * combine adjacent ranges, which merge_patterns() leaves alone,
+ * so they print as the biggest blocks
+ */
+static size_t set_join(struct netspec6 *r, size_t n)
+{
+	size_t i, o = 0;
+
+	for(i = 1; i < n; i++) {
+		v6addr next = r[o].max;
+
+		v6inc(&next);
+		if(v6cmp(r[i].min, next) == 0)
+			r[o].max = r[i].max;
+		else
+			r[++o] = r[i];
 	}
-# endif /* DEBUG */
-	if (optind >= argc) {
-		scan_read(stdin, NULL);
-	} else {
-		if(optind+1 >= argc) nonames = 1;	/* just one file, no name */
+	return n? o+1: 0;
+}
 
-		while(optind < argc) {
-			char *fn = argv[optind++];
-			FILE *f = fopen(fn, "r");
-			char *fmap;
-			size_t flen;
-			struct stat statbuf;
-		
-			if(!f) {
-				perror(fn);
-				return EXIT_ERROR;
-			}
-			if(fstat(fileno(f), &statbuf) != 0 || (statbuf.st_mode&S_IFMT)!= S_IFREG ) {
-				scan_read(f, fn);		/* can't stat or not a normal file, fall back to read */
-				fclose(f);
-				continue;
+/* the parts of merged ranges a[] also in b[], or not in b[] if sub */
+static size_t set_op(const struct netspec6 *a, size_t na,
+	const struct netspec6 *b, size_t nb, int sub, struct netspec6 *out)
+{
+	size_t i, j = 0, n = 0;
+
+	for(i = 0; i < na; i++) {
+		v6addr cur = a[i].min;	/* first address not yet done */
+		int done = 0;
+
+		while(j < nb && v6cmp(b[j].max, cur) < 0)
+			j++;
+		for(; j < nb && v6cmp(b[j].min, a[i].max) <= 0; j++) {
+			if(sub && v6cmp(b[j].min, cur) > 0) {	/* gap before b[j] */
+				out[n].min = cur;
+				out[n].max = b[j].min;
+				v6dec(&out[n++].max);
+			} else if(!sub) {	/* overlap with b[j] */
+				out[n].min = (v6cmp(b[j].min, cur) > 0)? b[j].min: cur;
+				out[n++].max = (v6cmp(b[j].max, a[i].max) < 0)? b[j].max: a[i].max;
 			}
-			flen = statbuf.st_size;
-			if(flen == 0) {
-				fclose(f);	/* empty file, forget it */
-				continue;
+			if(v6cmp(b[j].max, a[i].max) >= 0) {	/* b[j] runs past a[i] */
+				done = 1;
+				break;
 			}
+			cur = b[j].max;
+			v6inc(&cur);
+		}
+		if(sub && !done) {
+			out[n].min = cur;
+			out[n++].max = a[i].max;
+		}
+	}
+	return n;
+}
 
-			fmap = mmap(NULL, flen, PROT_READ, MAP_SHARED, fileno(f), (off_t)0);
-			if(fmap == MAP_FAILED) {
-				perror("map failed");
-				scan_read(f, fn);	/* can't map, fall back to read */
-				fclose(f);
-				continue;
+/* print a range as CIDR blocks, each as big as it can be */
+static unsigned long set_print_range(v6addr lo, const v6addr *hi, int v4)
+{
+	int bits = v4? 32: 128;
+	unsigned long n = 0;
+
+	for(;;) {
+		v6addr last = lo;	/* end of the block */
+		char buf[64];
+		int k;
+
+		for(k = 0; k < bits; k++) {
+			int x = 15 - k/8, bit = 1 << (k%8);
+
+			if(lo.a[x] & bit)
+				break;		/* not aligned for a bigger one */
+			last.a[x] |= bit;
+			if(v6cmp(last, *hi) > 0) {
+				last.a[x] &= ~bit;	/* past the end */
+				break;
 			}
+		}
+		if(v4)
+			fmt4(buf, (lo.a[12]<<24)|(lo.a[13]<<16)|(lo.a[14]<<8)|lo.a[15]);
+		else
+			fmt6(buf, &lo);
+		printf("%s/%d\n", buf, bits-k);
+		n++;
+		if(v6cmp(last, *hi) >= 0)
+			return n;
+		lo = last;
+		v6inc(&lo);
+	}
+}
 
-			scan_block(fmap, flen, fn);
-			munmap(fmap, flen);
-			fclose(f);
+/* print a[], or the set operation with b[] */
+static unsigned long set_print(struct netspec6 *a, size_t na,
+	const struct netspec6 *b, size_t nb, int v4)
+{
+	struct netspec6 *r = a;
+	unsigned long n = 0;
+	size_t i;
+
+	na = set_join(a, na);
+	if(setop != SETOP_AGGREGATE) {
+		r = calloc(na+nb+1, sizeof(struct netspec6));
+		if(!r) {
+			perror("Out of memory");
+			exit(EXIT_ERROR);
 		}
+		na = set_join(r, set_op(a, na, b, nb, setop == SETOP_SUBTRACT, r));
 	}
+	for(i = 0; i < na; i++)
+		n += set_print_range(r[i].min, &r[i].max, v4);
+	if(r != a)
+		free(r);
+	return n;
+}
 
-	/* Cleanup */
-	if (counting)
-		printf("%u\n", nmatch);
-	if (nmatch)
-		return EXIT_OK;
-	else
-		return EXIT_NOMATCH;
+/*
+ * A pattern store, from --compile, keeps each distinct range with
+ * a count of how many times it was given, sorted by netsort(), so
+ * that --apply-delta can take patterns away as well as add them.
+ * A delta is appended to a log at the end of the store, in time
+ * proportional to the delta, and --store folds the log in as it
+ * reads, one merge pass with no parsing or qsort() of the whole
+ * list, then the overlap pass merge_patterns() would do.
+ * When the log gets to 1/PS_FOLD of the store, --apply-delta
+ * rewrites it with the log folded in.
+ * Native byte order, like the index.
+ */
+#define PS_MAGIC	"GCPST1\n"
+#define PS_ORDER	0x01020304
+#define PS_FOLD		8
+#define PS_MINLOG	4096	/* don't fold a small store so often */
+
+struct pshdr {
+	char magic[8];
+	unsigned int order;	/* PS_ORDER, to catch a different byte order */
+	unsigned int pad;
+	unsigned long long n4;	/* ranges in each table */
+	unsigned long long n6;
+	unsigned long long nlog;	/* changes after them */
+};
+
+struct ps4 {
+	struct netspec r;
+	int cnt;
+	int pad;
+};
+
+/* also a log entry, with v4 set for a v4 range in the low 32 bits */
+struct ps6 {
+	struct netspec6 r;
+	int cnt;
+	int v4;
+};
+
+/* a log entry read back, with where it was to keep the changes in order */
+struct pslog {
+	struct ps6 e;
+	size_t at;
+};
+
+/* v4 log entries first, then by range */
+static int psrangesort(const struct pslog *x1, const struct pslog *x2)
+{
+	if(x1->e.v4 != x2->e.v4)
+		return x2->e.v4 - x1->e.v4;
+	return netsort6(&x1->e.r, &x2->e.r);
 }
 
-/* scan a line at a time */
-static void scan_read(FILE *f, const char *fn)
+/* and changes to the same range in the order they were made */
+static int pslogsort(const void *a, const void *b)
 {
-	ssize_t len;
+	const struct pslog *x1 = a, *x2 = b;
+	int c = psrangesort(x1, x2);
 
-	while((len = getline(&linep, &linesize, f)) > 0)
-	      scan_block(linep, len, fn);
+	if(c)
+		return c;
+	return (x1->at > x2->at) - (x1->at < x2->at);
 }
 
-static int netmatch(const struct netspec ip4);
-static int netmatch6(const struct netspec6 ip6);
+/* the v4 range in the low 32 bits of a log entry */
+static void ps_v4(const struct ps6 *e, struct netspec *r)
+{
+	const unsigned char *lo = e->r.min.a+12, *hi = e->r.max.a+12;
 
-/* scan some text, must be whole lines
- * generally either one line or the whole file
- * bp: pointer to buffer
- * blen: length of buffer
- * fn: filename for printing
- * This should handle the full V6 syntax in RFC 4291 sec 2.2 and 2.3 except for
+	r->min = (unsigned int)lo[0]<<24 | lo[1]<<16 | lo[2]<<8 | lo[3];
+	r->max = (unsigned int)hi[0]<<24 | hi[1]<<16 | hi[2]<<8 | hi[3];
+}
+
+/* read a store header, returns 0 if it's all right */
+static int ps_header(int fd, const char *fn, struct pshdr *h, struct stat *st)
+{
+	unsigned long long left;	/* bytes after the header */
+
+	if(fstat(fd, st) != 0 || pread(fd, h, sizeof(*h), 0) != sizeof(*h)
+	   || memcmp(h->magic, PS_MAGIC, sizeof(h->magic)) != 0 || h->order != PS_ORDER
+	   || (left = st->st_size - sizeof(*h), h->n4 > left/sizeof(struct ps4))
+	   || h->n6 > left/sizeof(struct ps6) || h->nlog > left/sizeof(struct ps6)
+	   || left < h->n4*sizeof(struct ps4) + (h->n6+h->nlog)*sizeof(struct ps6)) {
+		fprintf(stderr, "%s: not a grepcidr pattern store\n", fn);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * read a store with its log folded in, into new arrays of the
+ * ranges whose counts are still above zero
+ * Each range's changes are made in order, and one that would take
+ * the count below zero is dropped, so this agrees with any folds
+ * done along the way.
+ * returns 0 or -1 if it couldn't
+ */
+static int ps_read(const char *fn, struct ps4 **o4, size_t *n4, struct ps6 **o6, size_t *n6)
+{
+	struct pshdr h;
+	struct stat st;
+	const struct ps4 *b4;
+	const struct ps6 *b6;
+	struct pslog *log;
+	struct ps4 *l4;
+	char *map;
+	size_t i, j, n, nl4, bad = 0;
+	int fd = open(fn, O_RDONLY);
+
+	if(fd < 0) {
+		perror(fn);
+		return -1;
+	}
+	if(ps_header(fd, fn, &h, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		perror(fn);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	b4 = (const struct ps4 *)(map + sizeof(h));
+	b6 = (const struct ps6 *)(b4 + h.n4);
+	log = malloc(h.nlog*sizeof(struct pslog) + 1);
+	*o4 = malloc((h.n4 + h.nlog)*sizeof(struct ps4) + 1);
+	*o6 = malloc((h.n6 + h.nlog)*sizeof(struct ps6) + 1);
+	if(!log || !*o4 || !*o6) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < h.nlog; i++) {
+		log[i].e = b6[h.n6 + i];
+		log[i].at = i;
+	}
+	qsort(log, h.nlog, sizeof(struct pslog), pslogsort);
+	for(nl4 = 0; nl4 < h.nlog && log[nl4].e.v4; nl4++)
+		;
+
+	l4 = malloc(nl4*sizeof(struct ps4) + 1);
+	if(!l4) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < nl4; i++) {	/* still in order */
+		ps_v4(&log[i].e, &l4[i].r);
+		l4[i].cnt = log[i].e.cnt;
+	}
+
+	/* the same range in the store and the log, or several times in the log, add them up */
+	for(i = j = n = 0; i < h.n4 || j < nl4; ) {
+		struct ps4 e;
+
+		e.r = (j == nl4 || (i < h.n4 && netsort(&b4[i].r, &l4[j].r) <= 0))? b4[i].r: l4[j].r;
+		e.cnt = e.pad = 0;
+		if(i < h.n4 && netsort(&b4[i].r, &e.r) == 0)
+			e.cnt += b4[i++].cnt;
+		while(j < nl4 && netsort(&l4[j].r, &e.r) == 0) {
+			e.cnt += l4[j++].cnt;
+			if(e.cnt < 0) {		/* taken away when it wasn't there */
+				e.cnt = 0;
+				bad++;
+			}
+		}
+		if(e.cnt > 0)
+			(*o4)[n++] = e;
+	}
+	*n4 = n;
+	for(i = 0, j = nl4, n = 0; i < h.n6 || j < h.nlog; ) {
+		struct ps6 e;
+
+		e.r = (j == h.nlog || (i < h.n6 && netsort6(&b6[i].r, &log[j].e.r) <= 0))? b6[i].r: log[j].e.r;
+		e.cnt = e.v4 = 0;
+		if(i < h.n6 && netsort6(&b6[i].r, &e.r) == 0)
+			e.cnt += b6[i++].cnt;
+		while(j < h.nlog && netsort6(&log[j].e.r, &e.r) == 0) {
+			e.cnt += log[j++].e.cnt;
+			if(e.cnt < 0) {
+				e.cnt = 0;
+				bad++;
+			}
+		}
+		if(e.cnt > 0)
+			(*o6)[n++] = e;
+	}
+	*n6 = n;
+	if(bad)
+		fprintf(stderr, "%s: %lu removals of patterns that weren't there, ignored\n",
+			fn, (unsigned long)bad);
+	free(log);
+	free(l4);
+	munmap(map, st.st_size);
+	return 0;
+}
+
+/* write a store with no log, to a new file renamed over the old one */
+static int ps_write(const char *fn, const struct ps4 *a4, size_t n4, const struct ps6 *a6, size_t n6)
+{
+	struct pshdr h;
+	char *tmp = malloc(strlen(fn)+5);
+	FILE *f;
+
+	if(!tmp) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	sprintf(tmp, "%s.tmp", fn);
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PS_MAGIC, sizeof(h.magic));
+	h.order = PS_ORDER;
+	h.n4 = n4;
+	h.n6 = n6;
+	if(!(f = fopen(tmp, "w"))
+	   || fwrite(&h, sizeof(h), 1, f) != 1
+	   || fwrite(a4, sizeof(struct ps4), n4, f) != n4
+	   || fwrite(a6, sizeof(struct ps6), n6, f) != n6
+	   || fclose(f) != 0 || rename(tmp, fn) != 0) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* --compile, write the patterns loaded into array[] and array6[] as a store */
+static int store_compile(const char *fn)
+{
+	struct ps4 *a4 = malloc(npatterns*sizeof(struct ps4) + 1);
+	struct ps6 *a6 = malloc(n6patterns*sizeof(struct ps6) + 1);
+	size_t n4 = 0, n6 = 0, i;
+	int r;
+
+	if(!a4 || !a6) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	qsort(array, npatterns, sizeof(struct netspec), netsort);
+	qsort(array6, n6patterns, sizeof(struct netspec6), netsort6);
+	for(i = 0; i < npatterns; i++) {	/* count the same range given again */
+		if(n4 && netsort(&array[i], &a4[n4-1].r) == 0) {
+			a4[n4-1].cnt++;
+			continue;
+		}
+		a4[n4].r = array[i];
+		a4[n4].cnt = 1;
+		a4[n4++].pad = 0;
+	}
+	for(i = 0; i < n6patterns; i++) {
+		if(n6 && netsort6(&array6[i], &a6[n6-1].r) == 0) {
+			a6[n6-1].cnt++;
+			continue;
+		}
+		a6[n6].r = array6[i];
+		a6[n6].cnt = 1;
+		a6[n6++].v4 = 0;
+	}
+	r = ps_write(fn, a4, n4, a6, n6);
+	free(a4);
+	free(a6);
+	return r? EXIT_ERROR: EXIT_OK;
+}
+
+/* --store, load the patterns from a store, merged and ready to search */
+static int store_load(const char *fn)
+{
+	struct ps4 *a4;
+	struct ps6 *a6;
+	size_t n4, n6, i;
+
+	if(ps_read(fn, &a4, &n4, &a6, &n6) != 0)
+		return -1;
+	array = malloc(n4*sizeof(struct netspec) + 1);
+	array6 = malloc(n6*sizeof(struct netspec6) + 1);
+	if(!array || !array6) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < n4; i++)
+		array[i] = a4[i].r;
+	for(i = 0; i < n6; i++)
+		array6[i] = a6[i].r;
+	npatterns = capacity = n4;
+	n6patterns = capacity6 = n6;
+	free(a4);
+	free(a6);
+	combine_patterns();	/* already sorted */
+	return 0;
+}
+
+/* a range's count in the store's tables, before the log */
+static int ps_count(const struct ps4 *b4, size_t n4, const struct ps6 *b6, size_t n6,
+	const struct ps6 *e)
+{
+	if(e->v4) {
+		struct ps4 k;
+		const struct ps4 *f;
+
+		ps_v4(e, &k.r);
+		f = bsearch(&k, b4, n4, sizeof(struct ps4), netsort);
+		return f? f->cnt: 0;
+	} else {
+		const struct ps6 *f = bsearch(e, b6, n6, sizeof(struct ps6), netsort6);
+
+		return f? f->cnt: 0;
+	}
+}
+
+/*
+ * --apply-delta, add the patterns in a file with + and take away
+ * the ones with -, and fold the log in if it's got big
+ * The whole delta is checked first, and a line that isn't a pattern,
+ * or takes away one that isn't in the store, changes nothing unless
+ * -i says to skip it.
+ */
+static int store_delta(const char *fn, const char *dfn)
+{
+	struct pshdr h;
+	struct stat st;
+	struct ps6 *d = NULL;		/* the changes, in order */
+	char **text = NULL;		/* and their lines, NULL to skip */
+	struct pslog *c;		/* the log and then the changes, sorted */
+	size_t nd = 0, capd = 0, nc, nbad = 0, i, j;
+	const struct ps4 *b4;
+	const struct ps6 *b6;
+	FILE *df = fopen(dfn, "r");
+	char *map;
+	off_t end;
+	int fd;
+
+	if(!df) {
+		perror(dfn);
+		return EXIT_ERROR;
+	}
+	while(getline(&linep, &linesize, df) > 0) {
+		char *lp = linep;
+		struct ps6 e;
+
+		while(*lp == ' ' || *lp == '\t')
+			lp++;
+		if(*lp == '#' || *lp == '\n' || !*lp)
+			continue;
+		memset(&e, 0, sizeof(e));
+		e.cnt = (*lp == '-')? -1: 1;
+		if(*lp == '-' || *lp == '+')
+			lp++;
+		if(strchr(lp, ':')) {
+			if(!net_parse6(lp, &e.r)) {
+				if(!igbadpat)
+					fprintf(stderr, "Not a pattern: %s", linep);
+				nbad++;
+				continue;
+			}
+		} else {
+			struct netspec spec;
+			int b;
+
+			if(!net_parse(lp, &spec)) {
+				if(!igbadpat)
+					fprintf(stderr, "Not a pattern: %s", linep);
+				nbad++;
+				continue;
+			}
+			e.v4 = 1;
+			for(b = 0; b < 4; b++) {
+				e.r.min.a[12+b] = spec.min >> (24-8*b);
+				e.r.max.a[12+b] = spec.max >> (24-8*b);
+			}
+		}
+		if(nd == capd) {
+			capd = capd? capd*2: 1024;
+			d = realloc(d, capd*sizeof(struct ps6));
+			text = realloc(text, capd*sizeof(char *));
+			if(!d || !text) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
+		}
+		if(!(text[nd] = strdup(linep))) {
+			perror("Out of memory");
+			exit(EXIT_ERROR);
+		}
+		d[nd++] = e;
+	}
+	fclose(df);
+
+	if((fd = open(fn, O_RDWR)) < 0) {
+		perror(fn);
+		return EXIT_ERROR;
+	}
+	if(ps_header(fd, fn, &h, &st) != 0) {
+		close(fd);
+		return EXIT_ERROR;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		perror(fn);
+		close(fd);
+		return EXIT_ERROR;
+	}
+	b4 = (const struct ps4 *)(map + sizeof(h));
+	b6 = (const struct ps6 *)(b4 + h.n4);
+
+	/* take away only what's there, going through each range's changes in order */
+	nc = h.nlog + nd;
+	c = malloc(nc*sizeof(struct pslog) + 1);
+	if(!c) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < nc; i++) {
+		c[i].e = (i < h.nlog)? b6[h.n6 + i]: d[i - h.nlog];
+		c[i].at = i;
+	}
+	qsort(c, nc, sizeof(struct pslog), pslogsort);
+	for(i = 0; i < nc; i = j) {
+		int cnt = ps_count(b4, h.n4, b6, h.n6, &c[i].e);
+
+		for(j = i; j < nc && psrangesort(&c[j], &c[i]) == 0; j++) {
+			if(c[j].e.cnt > 0 || cnt > 0)
+				cnt += c[j].e.cnt;
+			else if(c[j].at >= h.nlog) {
+				char **t = &text[c[j].at - h.nlog];
+
+				if(!igbadpat)
+					fprintf(stderr, "Not in the store: %s", *t);
+				free(*t);
+				*t = NULL;
+				nbad++;
+			}
+		}
+	}
+	free(c);
+	munmap(map, st.st_size);
+	if(nbad && !igbadpat) {
+		close(fd);
+		for(i = 0; i < nd; i++)
+			free(text[i]);
+		free(text);
+		free(d);
+		return EXIT_ERROR;
+	}
+	for(i = j = 0; i < nd; i++) {	/* drop the ones -i skips */
+		if(text[i])
+			d[j++] = d[i];
+		free(text[i]);
+	}
+	nd = j;
+	free(text);
+
+	/* the changes after the last log entry, then the header that counts them */
+	end = sizeof(h) + h.n4*sizeof(struct ps4) + (h.n6+h.nlog)*sizeof(struct ps6);
+	h.nlog += nd;
+	if(pwrite(fd, d, nd*sizeof(struct ps6), end) != nd*sizeof(struct ps6)
+	   || pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || close(fd) != 0) {
+		perror(fn);
+		return EXIT_ERROR;
+	}
+	free(d);
+
+	if(h.nlog > PS_MINLOG && h.nlog > (h.n4 + h.n6) / PS_FOLD) {
+		struct ps4 *a4;
+		struct ps6 *a6;
+		size_t n4, n6;
+
+		if(ps_read(fn, &a4, &n4, &a6, &n6) != 0 || ps_write(fn, a4, n4, a6, n6) != 0)
+			return EXIT_ERROR;
+		free(a4);
+		free(a6);
+	}
+	return EXIT_OK;
+}
+
+int main(int argc, char* argv[])
+{
+	static char shortopts[] = "abcCDe:f:hij:lLm:nqrsvV";
+	static struct option longopts[] = {
+		{ "quiet",	no_argument,	NULL, OPT_QUIET },
+		{ "silent",	no_argument,	NULL, OPT_QUIET },
+		{ "follow",	no_argument,	NULL, OPT_FOLLOW },
+		{ "checkpoint",	required_argument,	NULL, OPT_CHECKPOINT },
+		{ "index",	no_argument,	NULL, OPT_INDEX },
+		{ "use-index",	no_argument,	NULL, OPT_USEINDEX },
+		{ "binary-input",	required_argument,	NULL, OPT_BININPUT },
+		{ "record-size",	required_argument,	NULL, OPT_RECSIZE },
+		{ "record-offset",	required_argument,	NULL, OPT_RECOFF },
+		{ "text-output",	no_argument,	NULL, OPT_TEXTOUT },
+		{ "pcap",	no_argument,	NULL, OPT_PCAP },
+		{ "write-pcap",	required_argument,	NULL, OPT_WRITEPCAP },
+		{ "memory",	required_argument,	NULL, OPT_MEMORY },
+		{ "external",	no_argument,	NULL, OPT_EXTERNAL },
+		{ "count-addresses",	no_argument,	NULL, OPT_COUNTADDR },
+		{ "top",	required_argument,	NULL, OPT_TOP },
+		{ "by-prefix",	required_argument,	NULL, OPT_BYPREFIX },
+		{ "by-prefix6",	required_argument,	NULL, OPT_BYPREFIX6 },
+		{ "aggregate",	no_argument,	NULL, OPT_AGGREGATE },
+		{ "intersect",	required_argument,	NULL, OPT_INTERSECT },
+		{ "subtract",	required_argument,	NULL, OPT_SUBTRACT },
+		{ "shard",	required_argument,	NULL, OPT_SHARD },
+		{ "rewrite",	no_argument,	NULL, OPT_REWRITE },
+		{ "rewrite-prefix",	required_argument,	NULL, OPT_RWPREFIX },
+		{ "rewrite-key",	required_argument,	NULL, OPT_RWKEY },
+		{ "json",	no_argument,	NULL, OPT_JSON },
+		{ "profile",	no_argument,	NULL, OPT_PROFILE },
+		{ "compile",	required_argument,	NULL, OPT_COMPILE },
+		{ "store",	required_argument,	NULL, OPT_STORE },
+		{ "apply-delta",	required_argument,	NULL, OPT_DELTA },
+		{ "blocks",	required_argument,	NULL, OPT_BLOCKS },
+		{ NULL, 0, NULL, 0 }
+	};
+	char* pat_filename = NULL;		/* filename containing patterns */
+	char* pat_strings = NULL;		/* pattern strings on command line */
+	int foundopt;
+
+	if (argc == 1)
+	{
+		fprintf(stderr, TXT_USAGE);
+		return EXIT_ERROR;
+	}
+
+	while ((foundopt = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1)
+	{
+		switch (foundopt)
+		{
+			case 'V':
+				puts(TXT_VERSION);
+				return EXIT_ERROR;
+				
+			case 'c':
+				counting = 1;
+				break;
+				
+			case 'v':
+				invert = 1;
+				break;
+				
+			case 'h':
+				nonames = 1;
+				break;
+
+			case 'a':
+				anchor = 1;
+				break;
+
+			case 'i':
+				igbadpat = 1;
+				break;
+
+			case 'q':
+				quick = 1;
+				break;
+
+			case 'r':
+				recursive = 1;
+				break;
+
+			case 'n':
+				numlines = 1;
+				break;
+
+			case 'b':
+				byteoffs = 1;
+				break;
+
+			case 'l':
+				listfiles = 1;
+				stopafter = 1;
+				break;
+
+			case 'L':
+				listfiles = -1;
+				stopafter = 1;
+				break;
+
+			case 'm': {
+				char *end;
+				unsigned long m = strtoul(optarg, &end, 10);
+
+				if(!isdigit((unsigned char)*optarg) || *end || m >= ~0U) {
+					fprintf(stderr, "Bad max count: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				stopafter = m;
+				break;
+			}
+
+			case OPT_QUIET:
+				silent = 1;
+				stopafter = 1;
+				break;
+
+			case OPT_FOLLOW:
+				follow = 1;
+				break;
+
+			case OPT_CHECKPOINT:
+				ckptfile = optarg;
+				break;
+
+			case OPT_INDEX:
+				indexing = 1;
+				break;
+
+			case OPT_USEINDEX:
+				useindex = 1;
+				break;
+
+			case OPT_BININPUT:
+				binaddr = atoi(optarg);
+				if(binaddr != 4 && binaddr != 6) {
+					fprintf(stderr, "--binary-input must be 4 or 6\n");
+					return EXIT_ERROR;
+				}
+				break;
+
+			case OPT_RECSIZE:
+			case OPT_RECOFF: {
+				char *end;
+				unsigned long n = strtoul(optarg, &end, 10);
+
+				if(!isdigit((unsigned char)*optarg) || *end || n > REC_MAX
+				   || (foundopt == OPT_RECSIZE && !n)) {
+					fprintf(stderr, "Bad record %s: %s\n",
+						foundopt == OPT_RECSIZE? "size": "offset", optarg);
+					return EXIT_ERROR;
+				}
+				if(foundopt == OPT_RECSIZE)
+					recsize = n;
+				else
+					recoff = n;
+				break;
+			}
+
+			case OPT_TEXTOUT:
+				bintext = 1;
+				break;
+
+			case OPT_PCAP:
+				pcapmode = 1;
+				break;
+
+			case OPT_MEMORY: {
+				char *ep;
+
+				memlimit = strtoull(optarg, &ep, 10);
+				switch(*ep) {
+					case 'k': case 'K': memlimit <<= 10; break;
+					case 'm': case 'M': memlimit <<= 20; break;
+					case 'g': case 'G': memlimit <<= 30; break;
+					case 't': case 'T': memlimit <<= 40; break;
+				}
+				if(!memlimit) {
+					fprintf(stderr, "Bad memory size: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				break;
+			}
+
+			case OPT_EXTERNAL:
+				external = 1;
+				break;
+
+			case OPT_COUNTADDR:
+				tallying = 1;
+				break;
+
+			case OPT_TOP:
+				topk = strtoul(optarg, NULL, 10);
+				if(!topk) {
+					fprintf(stderr, "Bad --top count: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				tallying = 1;
+				break;
+
+			case OPT_BYPREFIX:
+			case OPT_BYPREFIX6: {
+				int len = atoi(optarg);
+
+				if(len < 0 || len > (foundopt == OPT_BYPREFIX? 32: 128)) {
+					fprintf(stderr, "Bad prefix length: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				if(foundopt == OPT_BYPREFIX)
+					bypfx4 = len;
+				else
+					bypfx6 = len;
+				tallying = 1;
+				break;
+			}
+
+			case OPT_AGGREGATE:
+				setop = SETOP_AGGREGATE;
+				break;
+
+			case OPT_INTERSECT:
+				setop = SETOP_INTERSECT;
+				setfile = optarg;
+				break;
+
+			case OPT_SUBTRACT:
+				setop = SETOP_SUBTRACT;
+				setfile = optarg;
+				break;
+
+			case OPT_SHARD:
+				if(sscanf(optarg, "%d/%d", &shard, &nshards) != 2
+						|| nshards < 1 || shard < 1 || shard > nshards) {
+					fprintf(stderr, "Bad shard, should be I/N with I from 1 to N: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				break;
+
+			case OPT_REWRITE:
+				rewriting = 1;
+				break;
+
+			case OPT_RWPREFIX:
+				if(sscanf(optarg, "%d/%d", &rw4, &rw6) != 2
+						|| rw4 < 0 || rw4 > 32 || rw6 < 0 || rw6 > 128) {
+					fprintf(stderr, "Bad prefix lengths, should be V4LEN/V6LEN: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				rewriting = 1;
+				break;
+
+			case OPT_RWKEY:
+				rewrite_key(optarg);
+				rewriting = 1;
+				break;
+
+			case OPT_JSON:
+				jsonout = 1;
+				break;
+
+			case OPT_PROFILE:
+				profiling = 1;
+				break;
+
+			case OPT_COMPILE:
+				compfile = optarg;
+				break;
+
+			case OPT_STORE:
+				storefile = optarg;
+				break;
+
+			case OPT_DELTA:
+				deltafile = optarg;
+				break;
+
+			case OPT_WRITEPCAP:
+				pcapfile = optarg;
+				break;
+
+			case OPT_BLOCKS:
+				npblocks = atoi(optarg);
+				if(npblocks < 1) {
+					fprintf(stderr, "Bad block count: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				break;
+
+			case 'j':
+				nthreads = atoi(optarg);
+				if(nthreads < 1) {
+					fprintf(stderr, "Bad thread count: %s\n", optarg);
+					return EXIT_ERROR;
+				}
+				break;
+
+			case 's':
+				sloppy = 1;
+				break;
+
+			case 'D':
+				didrsearch = 1;
+				/* fall through */
+
+			case 'C':
+				cidrsearch = 1;
+				break;
+
+			case 'e':
+				pat_strings = optarg;
+				break;
+
+			case 'f':
+				pat_filename = optarg;
+				break;
+				
+			default:
+				fprintf(stderr, TXT_USAGE);
+				return EXIT_ERROR;
+		}
+	}
+	if (!memlimit) {
+		long pages = sysconf(_SC_PHYS_PAGES);
+
+		memlimit = (pages > 0)? (size_t)pages * sysconf(_SC_PAGESIZE) / 2: (size_t)1<<30;
+	}
+	if (profiling) {
+		prof_init(&prof);
+		atexit(prof_print);
+	}
+	if (indexing) {		/* no patterns, just the file */
+		if (optind != argc-1) {
+			fprintf(stderr, "--index needs one FILE\n");
+			return EXIT_ERROR;
+		}
+		pick_scanner();
+		return index_build(argv[optind]);
+	}
+	if (useindex && (anchor || quick || cidrsearch)) {
+		fprintf(stderr, "--use-index can't be used with -a, -q, -C, or -D\n");
+		return EXIT_ERROR;
+	}
+	if (useindex && ckptfile) {
+		fprintf(stderr, "--use-index can't be used with --checkpoint\n");
+		return EXIT_ERROR;
+	}
+	if (binaddr) {
+		size_t alen = (binaddr == 4)? 4: 16;
+
+		if(!recsize)
+			recsize = alen;
+		if(recoff + alen > recsize) {
+			fprintf(stderr, "Address at offset %lu doesn't fit in a %lu byte record\n",
+				(unsigned long)recoff, (unsigned long)recsize);
+			return EXIT_ERROR;
+		}
+		if(useindex || ckptfile || follow) {
+			fprintf(stderr, "--binary-input can't be used with --use-index, --checkpoint, or --follow\n");
+			return EXIT_ERROR;
+		}
+	} else if (recsize || recoff || bintext) {
+		fprintf(stderr, "--record-size, --record-offset, and --text-output need --binary-input\n");
+		return EXIT_ERROR;
+	}
+	if (pcapfile && !pcapmode) {
+		fprintf(stderr, "--write-pcap needs --pcap\n");
+		return EXIT_ERROR;
+	}
+	if (pcapfile && (counting || listfiles || silent)) {
+		fprintf(stderr, "--write-pcap can't be used with -c, -l, -L, or --quiet\n");
+		return EXIT_ERROR;
+	}
+	if (pcapmode && (binaddr || useindex || ckptfile || follow)) {
+		fprintf(stderr, "--pcap can't be used with --binary-input, --use-index, --checkpoint, or --follow\n");
+		return EXIT_ERROR;
+	}
+	if (tallying && (counting || stopafter != ~0U || cidrsearch
+			|| binaddr || pcapmode || useindex || follow)) {
+		fprintf(stderr, "--count-addresses can't be used with -c, -l, -L, -m, -C, -D, --quiet, "
+			"--binary-input, --pcap, --use-index, or --follow\n");
+		return EXIT_ERROR;
+	}
+	tally.budget = memlimit;
+	if (nshards && (binaddr || pcapmode || useindex || ckptfile || follow)) {
+		fprintf(stderr, "--shard can't be used with --binary-input, --pcap, --use-index, "
+			"--checkpoint, or --follow\n");
+		return EXIT_ERROR;
+	}
+	if (rewriting && (counting || stopafter != ~0U || invert || cidrsearch || tallying
+			|| binaddr || pcapmode || useindex)) {
+		fprintf(stderr, "--rewrite can't be used with -c, -l, -L, -m, -v, -C, -D, --quiet, "
+			"--count-addresses, --binary-input, --pcap, or --use-index\n");
+		return EXIT_ERROR;
+	}
+	if (jsonout && (counting || stopafter != ~0U || invert || cidrsearch || tallying
+			|| rewriting || setop || binaddr || pcapmode || useindex || storefile)) {
+		fprintf(stderr, "--json can't be used with -c, -l, -L, -m, -v, -C, -D, --quiet, "
+			"--count-addresses, --rewrite, --aggregate, --intersect, --subtract, "
+			"--binary-input, --pcap, --use-index, or --store\n");
+		return EXIT_ERROR;
+	}
+	if ((numlines || byteoffs) && (tallying || rewriting || setop || binaddr || pcapmode || useindex)) {
+		fprintf(stderr, "-n and -b can't be used with --count-addresses, --rewrite, --aggregate, "
+			"--intersect, --subtract, --binary-input, --pcap, or --use-index\n");
+		return EXIT_ERROR;
+	}
+	if (deltafile && !storefile) {
+		fprintf(stderr, "--apply-delta needs --store\n");
+		return EXIT_ERROR;
+	}
+	if (storefile && (compfile || pat_filename || pat_strings)) {
+		fprintf(stderr, "--store can't be used with --compile, -e, or -f\n");
+		return EXIT_ERROR;
+	}
+	if ((compfile || storefile) && external) {
+		fprintf(stderr, "--compile and --store can't be used with --external\n");
+		return EXIT_ERROR;
+	}
+	if (deltafile) {	/* just update the store */
+		if (optind < argc) {
+			fprintf(stderr, "--apply-delta doesn't read FILEs\n");
+			return EXIT_ERROR;
+		}
+		return store_delta(storefile, deltafile);
+	}
+	if (setop && external) {
+		fprintf(stderr, "--aggregate, --intersect, and --subtract can't be used with --external\n");
+		return EXIT_ERROR;
+	}
+	if (external) {		/* told to, start that way */
+		external = 0;
+		go_external();
+	}
+	if (!pat_filename && !pat_strings && !storefile)
+	{
+		if (optind < argc)
+			pat_strings = argv[optind++];
+		else
+		{
+			fprintf(stderr, "Specify PATTERN or -f FILE to read patterns from\n");
+			return EXIT_ERROR;
+		}
+	}
+
+	if (compfile) {		/* just save the patterns */
+		if (optind < argc) {
+			fprintf(stderr, "--compile doesn't read FILEs\n");
+			return EXIT_ERROR;
+		}
+		load_patterns(pat_filename, pat_strings);
+		if (external) {
+			fprintf(stderr, "Too many patterns for --memory\n");
+			return EXIT_ERROR;
+		}
+		return store_compile(compfile);
+	}
+	if (setop) {		/* just print the patterns, or a set operation */
+		struct netspec *b4 = NULL;
+		struct netspec6 *a4, *b6 = NULL, *b4x;
+		unsigned int nb4 = 0, nb6 = 0;
+		unsigned long n;
+
+		if (optind < argc) {
+			fprintf(stderr, "--aggregate, --intersect, and --subtract don't read FILEs\n");
+			return EXIT_ERROR;
+		}
+		if (setfile) {		/* the other list, set aside */
+			load_patterns(setfile, NULL);
+			merge_patterns();
+			b4 = array;
+			nb4 = npatterns;
+			b6 = array6;
+			nb6 = n6patterns;
+			array = NULL;
+			array6 = NULL;
+			npatterns = n6patterns = capacity = capacity6 = 0;
+		}
+		if (storefile) {
+			if (store_load(storefile) != 0)
+				return EXIT_ERROR;
+		} else
+			load_patterns(pat_filename, pat_strings);
+		if (external) {
+			fprintf(stderr, "Too many patterns for --memory\n");
+			return EXIT_ERROR;
+		}
+		merge_patterns();
+		a4 = set_to6(array, npatterns);
+		b4x = set_to6(b4, nb4);
+		n = set_print(a4, npatterns, b4x, nb4, 1);
+		n += set_print(array6, n6patterns, b6, nb6, 0);
+		return n? EXIT_OK: EXIT_NOMATCH;
+	}
+	prof_mark(PH_LOAD);
+	if (storefile) {
+		if (store_load(storefile) != 0)
+			return EXIT_ERROR;
+	} else
+		load_patterns(pat_filename, pat_strings);
+	prof_mark(PH_SORT);
+
+	if(external) {
+		if(anchor || quick || cidrsearch || binaddr || pcapmode || useindex || ckptfile || follow
+				|| tallying || nshards || rewriting || jsonout || numlines || byteoffs) {
+			fprintf(stderr, "With patterns sorted on disk, can't use -a, -q, -C, -D, -n, -b, "
+				"--binary-input, --pcap, --use-index, --checkpoint, --follow, "
+				"--count-addresses, --shard, --rewrite, or --json\n");
+			return EXIT_ERROR;
+		}
+		if(!xpat4.total && !xpat6.total) {
+			fprintf(stderr, "No patterns to match\n");
+			return EXIT_ERROR;
+		}
+		xpat_merge();
+		nthreads = 1;
+	} else if(!npatterns && !n6patterns) {
+		fprintf(stderr, "No patterns to match\n");
+		return EXIT_ERROR;
+	}
+
+	if(!storefile)		/* a store's are merged already */
+		merge_patterns();
+	if(npatterns >= COVER_MIN)
+		build_cover();
+	if(jsonout) {
+		json_build(0);
+		json_build(1);
+	}
+	build_small();
+	build_pack6();
+	pick_scanner();
+	prof_mark(-1);
+
+# if DEBUG
+	{	/* DEBUG */
+		int i,n;
+		for(n = 0; array6 && n < n6patterns; n++) {	/* not if packed */
+			printf("min %d:", n);
+			for(i = 0; i<16; i++) printf(" %02x", array6[n].min.a[i]);
+			printf("\nmax %d:",n);
+			for(i = 0; i<16; i++) printf(" %02x", array6[n].max.a[i]);
+			printf("\n");
+		}
+	}
+# endif /* DEBUG */
+	if (optind >= argc && follow) {
+		fprintf(stderr, "--follow needs a FILE\n");
+		return EXIT_ERROR;
+	}
+	if (ckptfile && follow) {
+		fprintf(stderr, "--checkpoint can't be used with --follow\n");
+		return EXIT_ERROR;
+	}
+	if (follow && (counting || listfiles < 0)) {	/* the files never end */
+		fprintf(stderr, "--follow can't be used with -c or -L\n");
+		return EXIT_ERROR;
+	}
+	if (pcapfile) {
+		/* opened once the options are checked, so a mistake doesn't truncate it */
+		if (strcmp(pcapfile, "-") == 0)
+			pcapout = stdout;
+		else if (!(pcapout = fopen(pcapfile, "w"))) {
+			perror(pcapfile);
+			return EXIT_ERROR;
+		}
+		nthreads = 1;	/* one writer, packets in order */
+	}
+	if (ckptfile)
+		ckpt_load();
+	if (optind >= argc && !recursive) {
+		struct scanfile sf = { NULL, 0, { NULL, 0, 0 }, -1 };
+
+		if(!stopafter || shard > 1)
+			;	/* -m 0, or not the first --shard */
+		else if(binaddr)
+			scan_binary(fileno(stdin), &sf);
+		else if(pcapmode)
+			scan_pcap(fileno(stdin), &sf);
+		else if(external)
+			xjoin(stdin, &sf);
+		else {
+			if(!nthreads) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+			/* blocks are scanned out of order, so not when counting lines or stopping early */
+			if(nthreads > 1 && stopafter == ~0U && !numlines && !byteoffs
+					&& !jsonout && !profiling && !nshards)
+				scan_pipe(&sf);
+			else
+				scan_read(stdin, -1, &sf);
+		}
+		file_done(&sf);
+		nmatch += sf.nmatch;
+	} else {
+		if(optind >= argc)
+			walk_dir(NULL);
+		while(optind < argc) {
+			char *fn = argv[optind++];
+			struct stat statbuf;
+
+			if(recursive && stat(fn, &statbuf) == 0 && S_ISDIR(statbuf.st_mode))
+				walk_dir(fn);
+			else
+				add_file(fn);
+		}
+		if(nfiles == 1 && !recursive) nonames = 1;	/* just one file, no name */
+		if(follow)
+			return follow_files();
+
+		if(!nthreads) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if(nthreads > nfiles) nthreads = nfiles;
+		if(nthreads > 1) {
+			if(scan_threaded() != 0)
+				return EXIT_ERROR;
+		} else {
+			int i;
+
+			if(!profiling)		/* output is timed after each block */
+				zc_init();
+			for(i = 0; i < nfiles; i++) {
+				struct scanfile sf = { files[i], 0, { NULL, 0, 0 }, -1 };
+
+				if(scan_file(files[i], &sf) != 0) {
+					perror(files[i]);
+					return EXIT_ERROR;
+				}
+				nmatch += sf.nmatch;
+			}
+		}
+		if(ckptfile && ckpt_save() != 0)
+			return EXIT_ERROR;
+	}
+
+	if (tallying) {
+		prof_mark(PH_OUTPUT);
+		tally_print();
+		prof_mark(-1);
+	}
+
+	/* Cleanup */
+	if (pcapout) {
+		if (pcaplink < 0)
+			pcap_header(1);		/* no packets, say Ethernet */
+		if ((pcapout == stdout? fflush(pcapout): fclose(pcapout)) != 0) {
+			perror("--write-pcap");
+			return EXIT_ERROR;
+		}
+	}
+	if (counting && !listfiles)
+		printf("%u\n", nmatch);
+	if (nmatch)
+		return EXIT_OK;
+	else
+		return EXIT_NOMATCH;
+}
+
+/* scan a line at a time, only left bytes' worth unless it's -1 */
+static void scan_read(FILE *f, off_t left, struct scanfile *sf)
+{
+	char *lp = NULL;	/* not linep, workers may be reading too */
+	size_t lsize = 0;
+	ssize_t len;
+
+	while(left && (len = getline(&lp, &lsize, f)) > 0) {
+		if(left > 0)
+			left = (len < left)? left-len: 0;
+		sf->bp = lp;
+		if(scan_block(lp, len, sf)) {
+			sf->stopped = 1;	/* seen enough */
+			break;
+		}
+		sf->boff += len;
+	}
+	free(lp);
+}
+
+/*
+ * after scanning a file, list its name for -l or -L,
+ * or for --quiet, we're done if it matched
+ */
+static void file_done(struct scanfile *sf)
+{
+	const char *fn = sf->fn? sf->fn: "(standard input)";
+
+	if(profiling)
+		prof_flush(sf);
+	if(silent && sf->nmatch)
+		exit(EXIT_OK);
+	if((listfiles > 0 && sf->nmatch) || (listfiles < 0 && !sf->nmatch)) {
+		out_write(sf, fn, strlen(fn));
+		out_write(sf, "\n", 1);
+	}
+}
+
+/*
+ * --shard I/N splits each file at I*size/N, rounded down to
+ * avoid overflow, and each line goes to the shard holding its newline
+ */
+static off_t shard_at(off_t size, int i)
+{
+	return size/nshards*i + size%nshards*i/nshards;
+}
+
+/*
+ * scan one named file, mapping it if possible
+ * returns 0 or errno if it couldn't be opened
+ */
+static int scan_file(const char *fn, struct scanfile *sf)
+{
+	FILE *f = fopen(fn, "r");
+	off_t start = 0, end, pos;
+	struct stat statbuf;
+
+	if(!f)
+		return errno;
+	if(!stopafter)
+		;	/* -m 0, don't look */
+	else if(binaddr)
+		scan_binary(fileno(f), sf);
+	else if(pcapmode)
+		scan_pcap(fileno(f), sf);
+	else if(external)
+		xjoin(f, sf);
+	else if(fstat(fileno(f), &statbuf) != 0 || (statbuf.st_mode&S_IFMT)!= S_IFREG ) {
+		if(shard <= 1)		/* the first shard gets all of these */
+			scan_read(f, -1, sf);	/* can't stat or not a normal file, fall back to read */
+	} else if(useindex && index_scan(fn, f, &statbuf, sf) == 0) {
+		;	/* answered from the index */
+	} else {
+		end = statbuf.st_size;
+		if(ckptfile) {	/* pick up where we left off, whole lines only */
+			start = ckpt_start(fileno(f), &statbuf);
+			end = whole_lines(fileno(f), start, end);
+		} else if(nshards) {	/* lines with their newline in our part */
+			if(shard > 1)
+				start = whole_lines(fileno(f), 0, shard_at(end, shard-1));
+			if(shard < nshards)
+				end = whole_lines(fileno(f), 0, shard_at(end, shard));
+		}
+		if((jsonout || numlines) && start > 0) {	/* line numbers from the top */
+			sf->lineno = lines_before(fileno(f), start);
+			sf->lnoff = start;
+		}
+		if(start < end) {	/* empty file, forget it */
+			pos = scan_map(fileno(f), start, end, sf);
+			if(pos < end) {
+				perror("map failed");
+				fseeko(f, pos, SEEK_SET);
+				sf->boff = pos;
+				scan_read(f, end-pos, sf);	/* can't map, fall back to read */
+				sf->stopped = 1;	/* and don't know where it ended */
+			}
+		}
+		if(ckptfile && !sf->stopped)
+			ckpt_done(fn, fileno(f), &statbuf, end);
+	}
+	fclose(f);
+	file_done(sf);
+	return 0;
+}
+
+/*
+ * scan part of a file through a window mapped MAPWINDOW at a time,
+ * so huge files don't need huge address space.
+ * Each window is cut at the last newline in it, and the next
+ * one starts at the page holding the rest of that line.
+ * For files bigger than one window, tell the kernel to read ahead
+ * the next window and drop the pages we're done with, so one scan
+ * doesn't flush the whole page cache.
+ * returns how far it got, less than end if a map failed
+ */
+static off_t scan_map(int fd, off_t start, off_t end, struct scanfile *sf)
+{
+	off_t pgsize = sysconf(_SC_PAGESIZE);
+	off_t pos = start;	/* first byte not yet scanned */
+	size_t win = MAPWINDOW;
+	int big = (end-start > MAPWINDOW);
+
+	/* in order with no names, lines can be copied from fd */
+	sf->zc = (zcmode != ZC_NONE && sf->jobx < 0 && !(sf->fn && !nonames) && !numlines && !byteoffs);
+	sf->zfd = fd;
+	sf->zlen = 0;
+
+	while(pos < end) {
+		off_t moff = pos - pos%pgsize;	/* mmap wants page alignment */
+		size_t mlen = win;
+		char *fmap, *bp, *ep;
+
+		if(end-moff < mlen)
+			mlen = end-moff;
+		fmap = mmap(NULL, mlen, PROT_READ, MAP_SHARED, fd, moff);
+		if(fmap == MAP_FAILED)
+			return pos;
+		madvise(fmap, mlen, MADV_SEQUENTIAL);
+		bp = fmap + (pos-moff);
+		ep = fmap + mlen;
+		if(moff+mlen < end) {	/* more to come, stop after the last whole line */
+			while(ep > bp && ep[-1] != '\n')
+				ep--;
+			if(ep == bp) {	/* line longer than the window, try a bigger one */
+				munmap(fmap, mlen);
+				win *= 2;
+				continue;
+			}
+			posix_fadvise(fd, moff+mlen, win, POSIX_FADV_WILLNEED);
+		}
+		sf->boff = pos;
+		sf->bp = bp;
+		if(scan_block(bp, ep-bp, sf)) {
+			ep = fmap+mlen, pos = end;	/* seen enough, stop here */
+			sf->stopped = 1;
+		}
+		else
+			pos += ep-bp;
+		zc_flush(sf);	/* while it's still mapped */
+		if(big) {
+			madvise(fmap, mlen, MADV_DONTNEED);
+			posix_fadvise(fd, moff, pos-moff, POSIX_FADV_DONTNEED);
+		}
+		munmap(fmap, mlen);
+	}
+	sf->zc = 0;
+	return pos;
+}
+
+/*
+ * output for a file, written straight through in the main thread,
+ * or saved up in a worker until it's this file's turn
+ */
+static void out_write(struct scanfile *sf, const char *p, size_t len)
+{
+	struct obuf *ob = &sf->out;
+
+	if(sf->jobx < 0 && !(profiling && PROF(sf)->inscan)) {
+		fwrite(p, 1, len, stdout);
+		return;
+	}
+	if(ob->len+len > ob->size) {
+		int head;
+
+		pthread_mutex_lock(&joblock);
+		head = (sf->jobx == headjob);
+		pthread_mutex_unlock(&joblock);
+		if(head && !profiling) {	/* earlier files all printed, no need to wait */
+			fwrite(ob->buf, 1, ob->len, stdout);
+			ob->len = 0;
+			if(len > ob->size) {
+				fwrite(p, 1, len, stdout);
+				return;
+			}
+		} else {
+			while(ob->len+len > ob->size)
+				ob->size = ob->size? ob->size*2: OBUF_INIT;
+			ob->buf = realloc(ob->buf, ob->size);
+			if(!ob->buf) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
+		}
+	}
+	memcpy(ob->buf+ob->len, p, len);
+	ob->len += len;
+}
+
+/* print text from the block being scanned */
+static void print_span(struct scanfile *sf, const char *p, size_t len)
+{
+	if(sf->zc) {	/* note it, adding to the previous span if it's next */
+		off_t off = sf->boff + (p - sf->bp);
+
+		if(off != sf->zoff + sf->zlen) {
+			zc_flush(sf);
+			sf->zoff = off;
+		}
+		sf->zlen += len;
+		return;
+	}
+	out_write(sf, p, len);
+}
+
+/* print a selected line, with the file name if there's more than one */
+static void print_line(struct scanfile *sf, const char *lp, size_t len)
+{
+	if(sf->fn && !nonames && !sf->zc) {
+		out_write(sf, sf->fn, strlen(sf->fn));
+		out_write(sf, ":", 1);
+	}
+	if(numlines || byteoffs) {
+		char buf[50];
+		int n = 0;
+
+		if(numlines) {
+			count_lines(sf, lp);
+			n = sprintf(buf, "%llu:", sf->lineno + 1);
+		}
+		if(byteoffs)
+			n += sprintf(buf+n, "%llu:", (unsigned long long)(sf->boff + (lp - sf->bp)));
+		out_write(sf, buf, n);
+	}
+	print_span(sf, lp, len);
+}
+
+/*
+ * Selected lines from a mapped file are written to stdout
+ * straight from the input file in runs of adjacent lines, which
+ * saves copying them through stdio, a big deal with -v when most
+ * lines are selected. copy_file_range() works when stdout is a
+ * file, splice() when it's a pipe, and sendfile() for most anything.
+ * If one fails, try the next, and as a last resort write from the map.
+ */
+static void zc_init(void)
+{
+#ifdef __linux__
+	struct stat st;
+
+	if(fstat(1, &st) != 0 || isatty(1))
+		return;
+	if(S_ISREG(st.st_mode))
+		zcmode = ZC_COPY;
+	else if(S_ISFIFO(st.st_mode))
+		zcmode = ZC_SPLICE;
+	else
+		zcmode = ZC_SENDFILE;
+#endif
+}
+
+static void zc_flush(struct scanfile *sf)
+{
+	off_t off = sf->zoff;
+	size_t len = sf->zlen;
+
+	if(!len)
+		return;
+	sf->zoff += len;
+	sf->zlen = 0;
+	fflush(stdout);		/* anything already printed goes first */
+	while(len > 0 && zcmode != ZC_NONE) {
+		ssize_t n = -1;
+
+#ifdef __linux__
+		if(zcmode == ZC_COPY)
+			n = copy_file_range(sf->zfd, &off, 1, NULL, len, 0);
+		else if(zcmode == ZC_SPLICE)
+			n = splice(sf->zfd, &off, 1, NULL, len, 0);
+		else
+			n = sendfile(1, sf->zfd, &off, len);
+#endif
+		if(n > 0)
+			len -= n;	/* off moved up too */
+		else if(n < 0 && errno == EINTR)
+			continue;
+		else
+			zcmode = (zcmode == ZC_SENDFILE)? ZC_NONE: ZC_SENDFILE;
+	}
+	if(len)
+		fwrite(sf->bp + (off - sf->boff), 1, len, stdout);
+}
+
+static void add_file(const char *fn)
+{
+	if(nfiles == capfiles) {
+		capfiles = capfiles? capfiles*2: 64;
+		files = realloc(files, capfiles*sizeof(char *));
+		if(!files) {
+			perror("Out of memory");
+			exit(EXIT_ERROR);
+		}
+	}
+	files[nfiles++] = strdup(fn);
+}
+
+/*
+ * add all the regular files under a directory, in sorted order
+ * so the output is the same every time. Symlinks are not followed.
+ * NULL is the current directory, with no ./ on the names, like grep.
+ */
+static void walk_dir(const char *dn)
+{
+	struct dirent **names;
+	int n, i;
+
+	n = scandir(dn? dn: ".", &names, NULL, alphasort);
+	if(n < 0) {
+		perror(dn? dn: ".");
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		char *name = names[i]->d_name;
+		char *path;
+		struct stat statbuf;
+
+		if(strcmp(name, ".") && strcmp(name, "..")) {
+			path = malloc((dn? strlen(dn)+1: 0)+strlen(name)+1);
+			if(!path) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
+			if(dn)
+				sprintf(path, "%s/%s", dn, name);
+			else
+				strcpy(path, name);
+			if(lstat(path, &statbuf) != 0)
+				perror(path);
+			else if(S_ISDIR(statbuf.st_mode))
+				walk_dir(path);
+			else if(S_ISREG(statbuf.st_mode))
+				add_file(path);
+			free(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+}
+
+/* worker thread, scan files until they're all taken */
+/* arg is the thread's --count-addresses table */
+static void *scan_worker(void *arg)
+{
+	struct prof pf;
+
+	if(profiling)
+		prof_init(&pf);
+	pthread_mutex_lock(&joblock);
+	while(nextjob < nfiles) {
+		struct job *j;
+
+		/* don't get too far ahead of the output */
+		if(nextjob >= headjob + JOBS_AHEAD*nthreads) {
+			pthread_cond_wait(&jobcond, &joblock);
+			continue;
+		}
+		j = &jobs[nextjob++];
+		pthread_mutex_unlock(&joblock);
+
+		j->sf.tl = arg;
+		j->sf.pf = profiling? &pf: NULL;
+		j->err = scan_file(j->fn, &j->sf);
+
+		pthread_mutex_lock(&joblock);
+		j->done = 1;
+		pthread_cond_broadcast(&jobcond);
+	}
+	if(profiling)
+		prof_merge(&pf);	/* still locked */
+	pthread_mutex_unlock(&joblock);
+	return NULL;
+}
+
+/*
+ * scan the files with a pool of worker threads, printing each
+ * file's output in order as it's finished
+ * returns 0 or -1 if a file couldn't be opened
+ */
+static int scan_threaded(void)
+{
+	pthread_t *tids;
+	struct tally *tls;
+	int i;
+
+	jobs = calloc(nfiles, sizeof(struct job));
+	tids = calloc(nthreads, sizeof(pthread_t));
+	tls = calloc(nthreads, sizeof(struct tally));
+	if(!jobs || !tids || !tls) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < nfiles; i++) {
+		jobs[i].fn = jobs[i].sf.fn = files[i];
+		jobs[i].sf.jobx = i;
+	}
+	tally.budget = memlimit/2;	/* and the rest shared by the threads */
+	for(i = 0; i < nthreads; i++) {
+		tls[i].budget = memlimit/2/nthreads;
+		if(pthread_create(&tids[i], NULL, scan_worker, &tls[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_ERROR);
+		}
+	}
+
+	for(i = 0; i < nfiles; i++) {
+		struct job *j = &jobs[i];
+
+		pthread_mutex_lock(&joblock);
+		while(!j->done)
+			pthread_cond_wait(&jobcond, &joblock);
+		pthread_mutex_unlock(&joblock);
+
+		if(j->err) {	/* same as the unthreaded case, stop here */
+			errno = j->err;
+			perror(j->fn);
+			return -1;
+		}
+		if(j->sf.out.len)
+			prof_mark(PH_OUTPUT);
+		fwrite(j->sf.out.buf, 1, j->sf.out.len, stdout);
+		prof_mark(-1);
+		free(j->sf.out.buf);
+		nmatch += j->sf.nmatch;
+
+		pthread_mutex_lock(&joblock);
+		headjob++;
+		pthread_cond_broadcast(&jobcond);
+		pthread_mutex_unlock(&joblock);
+	}
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		tally_merge(&tls[i]);
+	}
+	free(tids);
+	free(tls);
+	return 0;
+}
+
+/* is there more input waiting right now? */
+static int input_ready(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * reader thread, cut standard input into blocks of whole lines,
+ * a block ending at a full buffer or when there's nothing more
+ * to read just yet, so slow input isn't held back
+ */
+static void *pipe_reader(void *arg)
+{
+	char *carry = NULL;	/* partial line for the next block */
+	size_t clen = 0, csize = 0;
+	off_t off = 0;
+	int seq, eof = 0;
+
+	(void)arg;
+	for(seq = 0; !eof; ) {
+		struct pblock *b = &pblocks[seq % npblocks];
+		size_t nl = 0;		/* just after the last newline */
+		size_t cut;
+
+		pthread_mutex_lock(&joblock);
+		while(seq >= headjob + npblocks)	/* slot still in use */
+			pthread_cond_wait(&jobcond, &joblock);
+		pthread_mutex_unlock(&joblock);
+
+		if(b->size < PIPE_BLOCK || b->size < clen*2) {
+			b->size = clen*2 > PIPE_BLOCK? clen*2: PIPE_BLOCK;
+			free(b->buf);
+			b->buf = malloc(b->size);
+			if(!b->buf) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
+		}
+		memcpy(b->buf, carry, clen);
+		b->len = clen;
+		for(;;) {
+			ssize_t n;
+			char *q;
+
+			if(b->len == b->size) {
+				if(nl)
+					break;
+				b->size *= 2;	/* a line longer than a block */
+				b->buf = realloc(b->buf, b->size);
+				if(!b->buf) {
+					perror("Out of memory");
+					exit(EXIT_ERROR);
+				}
+			}
+			n = read(0, b->buf + b->len, b->size - b->len);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0) {
+				if(n < 0)
+					perror("(standard input)");
+				eof = 1;
+				break;
+			}
+			for(q = b->buf + b->len + n; q > b->buf + b->len; )
+				if(*--q == '\n') {
+					nl = q+1 - b->buf;
+					break;
+				}
+			b->len += n;
+			if(nl && b->len < b->size && !input_ready(0))
+				break;
+		}
+
+		cut = eof? b->len: nl;
+		clen = b->len - cut;
+		if(clen > csize) {
+			csize = clen*2;
+			carry = realloc(carry, csize);
+			if(!carry) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
+		}
+		memcpy(carry, b->buf + cut, clen);
+		b->len = cut;
+
+		b->sf.nmatch = 0;
+		b->sf.jobx = seq;
+		b->sf.boff = off;
+		b->done = 0;
+		off += cut;
+		pthread_mutex_lock(&joblock);
+		if(b->len)
+			nread = ++seq;
+		readeof = eof;
+		pthread_cond_broadcast(&jobcond);
+		pthread_mutex_unlock(&joblock);
+	}
+	free(carry);
+	return NULL;
+}
+
+/* worker thread, scan blocks of standard input as they're read */
+/* arg is the thread's --count-addresses table */
+static void *pipe_worker(void *arg)
+{
+	pthread_mutex_lock(&joblock);
+	for(;;) {
+		struct pblock *b;
+
+		if(nextjob >= nread) {
+			if(readeof)
+				break;
+			pthread_cond_wait(&jobcond, &joblock);
+			continue;
+		}
+		b = &pblocks[nextjob++ % npblocks];
+		pthread_mutex_unlock(&joblock);
+
+		b->sf.tl = arg;
+		b->sf.bp = b->buf;
+		scan_block(b->buf, b->len, &b->sf);
+
+		pthread_mutex_lock(&joblock);
+		b->done = 1;
+		pthread_cond_broadcast(&jobcond);
+	}
+	pthread_mutex_unlock(&joblock);
+	return NULL;
+}
+
+/*
+ * scan standard input with a reader thread cutting it into blocks
+ * and a pool of workers, printing each block's output in order
+ * like scan_threaded(). At most npblocks are read ahead of the output.
+ */
+static void scan_pipe(struct scanfile *sf)
+{
+	pthread_t rtid, *tids;
+	struct tally *tls;
+	int i, seq;
+
+	if(!npblocks)
+		npblocks = JOBS_AHEAD*nthreads;
+	pblocks = calloc(npblocks, sizeof(struct pblock));
+	tids = calloc(nthreads, sizeof(pthread_t));
+	tls = calloc(nthreads, sizeof(struct tally));
+	if(!pblocks || !tids || !tls) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < npblocks; i++) {
+		pblocks[i].sf = *sf;
+		pblocks[i].sf.out.buf = NULL;
+		pblocks[i].sf.out.len = pblocks[i].sf.out.size = 0;
+	}
+	tally.budget = memlimit/2;	/* and the rest shared by the threads */
+	if(pthread_create(&rtid, NULL, pipe_reader, NULL) != 0) {
+		perror("pthread_create");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < nthreads; i++) {
+		tls[i].budget = memlimit/2/nthreads;
+		if(pthread_create(&tids[i], NULL, pipe_worker, &tls[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_ERROR);
+		}
+	}
+
+	for(seq = 0; ; seq++) {
+		struct pblock *b = &pblocks[seq % npblocks];
+
+		pthread_mutex_lock(&joblock);
+		while(!(seq < nread && b->done) && !(readeof && seq >= nread))
+			pthread_cond_wait(&jobcond, &joblock);
+		pthread_mutex_unlock(&joblock);
+		if(seq >= nread)
+			break;
+
+		fwrite(b->sf.out.buf, 1, b->sf.out.len, stdout);
+		b->sf.out.len = 0;
+		sf->nmatch += b->sf.nmatch;
+
+		pthread_mutex_lock(&joblock);
+		headjob++;
+		pthread_cond_broadcast(&jobcond);
+		pthread_mutex_unlock(&joblock);
+	}
+	pthread_join(rtid, NULL);
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		tally_merge(&tls[i]);
+	}
+	for(i = 0; i < npblocks; i++) {
+		free(pblocks[i].buf);
+		free(pblocks[i].sf.out.buf);
+	}
+	free(pblocks);
+	free(tids);
+	free(tls);
+}
+
+/*
+ * --checkpoint FILE remembers how far each file was scanned, so
+ * a job run over growing logs only looks at what's new.
+ * The file has a line per input file:
+ *	dev ino offset fplen fingerprint name
+ */
+
+/* ckpthash[] slot for a file, its entry or a free one to put it in */
+static unsigned int ckpt_slot(unsigned long long dev, unsigned long long ino)
+{
+	unsigned int h = (unsigned int)((ino * 0x9e3779b97f4a7c15ULL ^ dev) >> 32) & (ckpthsize-1);
+	int x;
+
+	while((x = ckpthash[h]) && (ckpts[x-1].dev != dev || ckpts[x-1].ino != ino))
+		h = (h+1) & (ckpthsize-1);
+	return h;
+}
+
+static struct ckpt *ckpt_find(dev_t dev, ino_t ino)
+{
+	int x;
+
+	if(!nckpts)
+		return NULL;
+	x = ckpthash[ckpt_slot(dev, ino)];
+	return x? &ckpts[x-1]: NULL;
+}
+
+/* a new entry for a file not in ckpts[] yet */
+static struct ckpt *ckpt_add(unsigned long long dev, unsigned long long ino)
+{
+	struct ckpt *c;
+	int i;
+
+	if(nckpts == capckpts) {
+		capckpts = capckpts? capckpts*2: 64;
+		ckpts = realloc(ckpts, capckpts*sizeof(struct ckpt));
+		if(!ckpts) {
+			perror("Out of memory");
+			exit(EXIT_ERROR);
+		}
+	}
+	if((nckpts+1)*2 > ckpthsize) {	/* keep it at most half full */
+		ckpthsize = ckpthsize? ckpthsize*2: 128;
+		free(ckpthash);
+		ckpthash = calloc(ckpthsize, sizeof(int));
+		if(!ckpthash) {
+			perror("Out of memory");
+			exit(EXIT_ERROR);
+		}
+		for(i = 0; i < nckpts; i++)
+			ckpthash[ckpt_slot(ckpts[i].dev, ckpts[i].ino)] = i+1;
+	}
+	c = &ckpts[nckpts];
+	memset(c, 0, sizeof(struct ckpt));
+	c->dev = dev;
+	c->ino = ino;
+	ckpthash[ckpt_slot(dev, ino)] = ++nckpts;
+	return c;
+}
+
+static void ckpt_load(void)
+{
+	FILE *f = fopen(ckptfile, "r");
+	char *lp = NULL;
+	size_t lsize = 0;
+
+	if(!f) {
+		if(errno == ENOENT)
+			return;		/* first run */
+		perror(ckptfile);
+		exit(EXIT_ERROR);
+	}
+	while(getline(&lp, &lsize, f) > 0) {
+		unsigned long long dev, ino, off, fp;
+		unsigned int fplen;
+		int n;
+		struct ckpt *c;
+
+		if(*lp == '#')
+			continue;
+		if(sscanf(lp, "%llu %llu %llu %u %llx %n", &dev, &ino, &off, &fplen, &fp, &n) != 5) {
+			fprintf(stderr, "%s: bad checkpoint line: %s", ckptfile, lp);
+			exit(EXIT_ERROR);
+		}
+		lp[strcspn(lp, "\n")] = 0;
+		if(ckpt_find(dev, ino))
+			continue;	/* the same file under two names, keep the first */
+		c = ckpt_add(dev, ino);
+		c->off = off;
+		c->fplen = fplen;
+		c->fp = fp;
+		c->fn = strdup(lp+n);
+	}
+	free(lp);
+	fclose(f);
+}
+
+/*
+ * write the new checkpoint beside the old one and rename it over,
+ * so a crash leaves one or the other.
+ * Files not scanned this time are kept if they're still there.
+ */
+static int ckpt_save(void)
+{
+	char *tmp = malloc(strlen(ckptfile)+5);
+	FILE *f;
+	int i;
+
+	if(!tmp) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	sprintf(tmp, "%s.tmp", ckptfile);
+	if(!(f = fopen(tmp, "w"))) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	fprintf(f, "# grepcidr checkpoint: dev ino offset fplen fingerprint name\n");
+	for(i = 0; i < nckpts; i++) {
+		struct ckpt *c = &ckpts[i];
+		struct stat st;
+
+		if(c->seen) {
+			c->off = c->newoff;
+			c->fplen = c->newfplen;
+			c->fp = c->newfp;
+		} else if(stat(c->fn, &st) != 0 || st.st_dev != c->dev || st.st_ino != c->ino)
+			continue;	/* gone, or rotated away */
+		fprintf(f, "%llu %llu %llu %u %016llx %s\n", c->dev, c->ino,
+			(unsigned long long)c->off, c->fplen, c->fp,
+			strchr(c->fn, '\n')? "-": c->fn);
+	}
+	if(fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0
+	   || rename(tmp, ckptfile) != 0) {
+		perror(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+/* FNV-1a hash of the first len bytes of a file, 0 if it can't be read */
+static unsigned long long ckpt_hash(int fd, unsigned int len)
+{
+	unsigned char buf[CKPT_FPLEN];
+	unsigned long long h = 14695981039346656037ULL;
+	unsigned int i;
+
+	if(pread(fd, buf, len, 0) != len)
+		return 0;
+	for(i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* where to start scanning, 0 if the file's new, shorter, or changed */
+static off_t ckpt_start(int fd, const struct stat *st)
+{
+	struct ckpt *c;
+	off_t off = 0;
+	unsigned int fplen = 0;
+	unsigned long long fp = 0;
+
+	pthread_mutex_lock(&ckptlock);
+	if((c = ckpt_find(st->st_dev, st->st_ino)) != NULL) {
+		off = c->off;
+		fplen = c->fplen;
+		fp = c->fp;
+	}
+	pthread_mutex_unlock(&ckptlock);
+	if(off > st->st_size || fplen > off || ckpt_hash(fd, fplen) != fp)
+		return 0;
+	return off;
+}
+
+/* end of the last whole line, a partial one waits for next time */
+static off_t whole_lines(int fd, off_t start, off_t end)
+{
+	char buf[65536];
+
+	while(end > start) {
+		size_t n = end-start < sizeof(buf)? end-start: sizeof(buf);
+		char *p;
+
+		if(pread(fd, buf, n, end-n) != n)
+			break;
+		for(p = buf+n; p > buf; p--)
+			if(p[-1] == '\n')
+				return end-n + (p-buf);
+		end -= n;
+	}
+	return start;
+}
+
+/* note how far this run got */
+static void ckpt_done(const char *fn, int fd, const struct stat *st, off_t end)
+{
+	unsigned int fplen = end < CKPT_FPLEN? end: CKPT_FPLEN;
+	unsigned long long fp = ckpt_hash(fd, fplen);
+	struct ckpt *c;
+
+	pthread_mutex_lock(&ckptlock);
+	if(!(c = ckpt_find(st->st_dev, st->st_ino)))
+		c = ckpt_add(st->st_dev, st->st_ino);
+	if(!c->seen || end > c->newoff) {	/* same file twice, keep the later */
+		c->seen = 1;
+		c->newoff = end;
+		c->newfplen = fplen;
+		c->newfp = fp;
+		free(c->fn);
+		c->fn = strdup(fn);
+	}
+	pthread_mutex_unlock(&ckptlock);
+}
+
+/*
+ * --index FILE writes an index of every address in FILE and the
+ * offset of the line it's on, sorted by address, and --use-index
+ * looks up the patterns in FILE.gcidx rather than reading FILE,
+ * then reads just the lines that match.
+ * The index is in native byte order, a header then the v4 and v6
+ * entries. It records the size and modification time of FILE,
+ * and is ignored if they've changed.
+ * An IPv4 address embedded in IPv6 is entered both ways, with
+ * IX_EMBED set, since the scanner tries it both ways.
+ */
+#define IX_MAGIC	"GCIDX1\n"
+#define IX_ORDER	0x01020304
+#define IX_EMBED	(1ULL<<63)	/* in line, embedded v4 */
+
+struct ixhdr {
+	char magic[8];
+	unsigned int order;	/* IX_ORDER, to catch a different byte order */
+	unsigned int pad;
+	unsigned long long size;	/* size of the file indexed */
+	long long mtime;	/* and its modification time */
+	unsigned long long n4;	/* entries in each table */
+	unsigned long long n6;
+};
+
+struct ix4 {
+	unsigned int addr;
+	unsigned int pad;
+	unsigned long long line;	/* offset of the line, maybe IX_EMBED */
+};
+
+struct ix6 {
+	v6addr addr;
+	unsigned long long line;
+};
+
+/* called from the scanner for each address */
+static void ix_add4(unsigned int addr, unsigned long long line)
+{
+	struct ix4 e;
+
+	e.addr = addr;
+	e.pad = 0;
+	e.line = line;
+	xs_add(&ixs4, &e);
+}
+
+static void ix_add6(const v6addr *addr, unsigned long long line)
+{
+	struct ix6 e;
+
+	e.addr = *addr;
+	e.line = line;
+	xs_add(&ixs6, &e);
+}
+
+static int ix4sort(const void *a, const void *b)
+{
+	const struct ix4 *x1 = a, *x2 = b;
+
+	if(x1->addr != x2->addr)
+		return x1->addr < x2->addr? -1: 1;
+	if(x1->line != x2->line)
+		return x1->line < x2->line? -1: 1;
+	return 0;
+}
+
+static int ix6sort(const void *a, const void *b)
+{
+	const struct ix6 *x1 = a, *x2 = b;
+	int r = v6cmp(x1->addr, x2->addr);
+
+	if(r)
+		return r;
+	if(x1->line != x2->line)
+		return x1->line < x2->line? -1: 1;
+	return 0;
+}
+
+static int linesort(const void *a, const void *b)
+{
+	unsigned long long l1 = *(const unsigned long long *)a;
+	unsigned long long l2 = *(const unsigned long long *)b;
+
+	return (l1 > l2) - (l1 < l2);
+}
+
+/* build the index for a file, and write it to stdout */
+static int index_build(const char *fn)
+{
+	struct scanfile sf = { fn, 0, { NULL, 0, 0 }, -1 };
+	struct ixhdr h;
+	struct ix4 e4;
+	struct ix6 e6;
+	struct stat st;
+	off_t end;
+	int fd = open(fn, O_RDONLY);
+
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		perror(fn);
+		return EXIT_ERROR;
+	}
+	if(!S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: can only index a regular file\n", fn);
+		return EXIT_ERROR;
+	}
+	xs_init(&ixs4, sizeof(struct ix4), ix4sort, memlimit/2);
+	xs_init(&ixs6, sizeof(struct ix6), ix6sort, memlimit/2);
+	end = whole_lines(fd, 0, st.st_size);	/* same as a scan, partial line ignored */
+	if(scan_map(fd, 0, end, &sf) < end) {
+		perror(fn);
+		return EXIT_ERROR;
+	}
+	close(fd);
+	xs_finish(&ixs4);
+	xs_finish(&ixs6);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IX_MAGIC, sizeof(h.magic));
+	h.order = IX_ORDER;
+	h.size = st.st_size;
+	h.mtime = st.st_mtime;
+	h.n4 = ixs4.total;
+	h.n6 = ixs6.total;
+	fwrite(&h, sizeof(h), 1, stdout);
+	while(xs_next(&ixs4, &e4))
+		fwrite(&e4, sizeof(e4), 1, stdout);
+	while(xs_next(&ixs6, &e6))
+		fwrite(&e6, sizeof(e6), 1, stdout);
+	if(fflush(stdout) != 0 || ferror(stdout)) {
+		perror("stdout");
+		return EXIT_ERROR;
+	}
+	return EXIT_OK;
+}
+
+/* add a line to the list */
+static void ix_line(unsigned long long **lines, size_t *n, size_t *cap, unsigned long long line)
+{
+	if(*n == *cap) {
+		*cap = *cap? *cap*2: 1024;
+		*lines = realloc(*lines, *cap*sizeof(unsigned long long));
+		if(!*lines) {
+			perror("Out of memory");
+			exit(EXIT_ERROR);
+		}
+	}
+	(*lines)[(*n)++] = line & ~IX_EMBED;
+}
+
+/* sort the lines and drop duplicates, returns the new count */
+static size_t ix_uniq(unsigned long long *lines, size_t n)
+{
+	size_t i, o;
+
+	qsort(lines, n, sizeof(unsigned long long), linesort);
+	for(i = o = 0; i < n; i++)
+		if(!o || lines[i] != lines[o-1])
+			lines[o++] = lines[i];
+	return o;
+}
+
+/*
+ * answer a query on an open file from its index, if it has a
+ * current one.
+ * returns 0 if it did, -1 to scan the file instead
+ */
+static int index_scan(const char *fn, FILE *f, const struct stat *st, struct scanfile *sf)
+{
+	char *ixfn = malloc(strlen(fn)+7);
+	const struct ixhdr *h;
+	const struct ix4 *x4;
+	const struct ix6 *x6;
+	struct stat ixst;
+	unsigned long long left;	/* bytes after the header */
+	char *map;
+	int fd;
+	unsigned long long *hits = NULL, *seen = NULL;
+	size_t nhits = 0, caphits = 0, nseen = 0, capseen = 0, i, j, n;
+	char *lp = NULL;
+	size_t lsize = 0;
+	ssize_t len;
+	struct p6iter it6 = { packed6.n? &packed6: NULL };
+
+	if(!ixfn) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	sprintf(ixfn, "%s.gcidx", fn);
+	fd = open(ixfn, O_RDONLY);
+	if(fd < 0) {
+		if(errno != ENOENT)
+			perror(ixfn);
+		free(ixfn);
+		return -1;	/* no index, just scan it */
+	}
+	if(fstat(fd, &ixst) != 0 || ixst.st_size < sizeof(struct ixhdr)
+	   || (map = mmap(NULL, ixst.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "%s: can't read index, scanning\n", ixfn);
+		close(fd);
+		free(ixfn);
+		return -1;
+	}
+	close(fd);
+	h = (const struct ixhdr *)map;
+	left = ixst.st_size - sizeof(struct ixhdr);	/* bound the counts so they can't wrap */
+	if(memcmp(h->magic, IX_MAGIC, sizeof(h->magic)) != 0 || h->order != IX_ORDER
+	   || h->n4 > left/sizeof(struct ix4) || h->n6 > left/sizeof(struct ix6)
+	   || left != h->n4*sizeof(struct ix4) + h->n6*sizeof(struct ix6)) {
+		fprintf(stderr, "%s: not a grepcidr index, scanning\n", ixfn);
+		goto fail;
+	}
+	if(h->size != st->st_size || h->mtime != st->st_mtime) {
+		fprintf(stderr, "%s: index is out of date, scanning\n", ixfn);
+		goto fail;
+	}
+	x4 = (const struct ix4 *)(h+1);
+	x6 = (const struct ix6 *)(x4+h->n4);
+
+	/* each merged range is a run of entries in the index */
+	for(i = 0; i < npatterns; i++) {
+		size_t lo = 0, hi = h->n4;
+
+		while(lo < hi) {	/* first entry >= min */
+			size_t mid = lo + (hi-lo)/2;
+
+			if(x4[mid].addr < array[i].min)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		for(; lo < h->n4 && x4[lo].addr <= array[i].max; lo++)
+			ix_line(&hits, &nhits, &caphits, x4[lo].line);
+	}
+	while(p6next(&it6)) {
+		size_t lo = 0, hi = h->n6;
+
+		while(lo < hi) {
+			size_t mid = lo + (hi-lo)/2;
+
+			if(v6cmp(x6[mid].addr, it6.r.min) < 0)
+				lo = mid+1;
+			else
+				hi = mid;
+		}
+		for(; lo < h->n6 && v6cmp(x6[lo].addr, it6.r.max) <= 0; lo++)
+			ix_line(&hits, &nhits, &caphits, x6[lo].line);
+	}
+	nhits = ix_uniq(hits, nhits);
+
+	/*
+	 * -v wants lines with an address that didn't match, where
+	 * as in the scanner an address only counts if there are
+	 * patterns of its type, or it's embedded v4
+	 */
+	if(invert) {
+		for(i = 0; i < h->n4; i++)
+			if(npatterns || (x4[i].line & IX_EMBED))
+				ix_line(&seen, &nseen, &capseen, x4[i].line);
+		for(i = 0; i < h->n6; i++)
+			if(n6patterns || (x6[i].line & IX_EMBED))
+				ix_line(&seen, &nseen, &capseen, x6[i].line);
+		nseen = ix_uniq(seen, nseen);
+		for(i = j = n = 0; i < nseen; i++) {	/* seen but not hit */
+			while(j < nhits && hits[j] < seen[i])
+				j++;
+			if(j == nhits || hits[j] != seen[i])
+				seen[n++] = seen[i];
+		}
+		free(hits);
+		hits = seen;
+		nhits = n;
+	}
+	munmap(map, ixst.st_size);
+	free(ixfn);
+
+	for(i = 0; i < nhits; i++) {
+		sf->nmatch++;
+		if(!(counting || listfiles || silent)) {
+			if(fseeko(f, hits[i], SEEK_SET) != 0
+			   || (len = getline(&lp, &lsize, f)) <= 0) {
+				perror(fn);
+				break;
+			}
+			print_line(sf, lp, len);
+		}
+		if(sf->nmatch >= stopafter) {
+			sf->stopped = 1;
+			break;
+		}
+	}
+	free(lp);
+	free(hits);
+	return 0;
+
+fail:
+	munmap(map, ixst.st_size);
+	free(ixfn);
+	return -1;
+}
+
+/*
+ * External sort, for more records than fit in memory.
+ * Records collect in a buffer, and when it's full it's sorted and
+ * written to a temporary file as a run. Reading them back merges
+ * the runs, or if there was only the one buffer, just sorts it.
+ * Temporary files go in $TMPDIR or /tmp and are unlinked at once.
+ */
+static FILE *xs_tmpfile(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char *path;
+	FILE *f;
+	int fd;
+
+	if(!dir || !*dir)
+		dir = "/tmp";
+	path = malloc(strlen(dir) + 20);
+	if(!path) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	sprintf(path, "%s/grepcidrXXXXXX", dir);
+	if((fd = mkstemp(path)) < 0 || !(f = fdopen(fd, "w+"))) {
+		perror(path);
+		exit(EXIT_ERROR);
+	}
+	unlink(path);
+	free(path);
+	return f;
+}
+
+static void xs_init(struct xsort *xs, size_t rsize, int (*cmp)(const void *, const void *), size_t budget)
+{
+	memset(xs, 0, sizeof(*xs));
+	xs->rsize = rsize;
+	xs->cmp = cmp;
+	xs->cap = budget/rsize;
+	if(xs->cap < 1024)
+		xs->cap = 1024;
+}
+
+/* write out the buffer as a sorted run */
+static void xs_spill(struct xsort *xs)
+{
+	FILE *f = xs_tmpfile();
+
+	qsort(xs->buf, xs->n, xs->rsize, xs->cmp);
+	if(fwrite(xs->buf, xs->rsize, xs->n, f) != xs->n || fflush(f) != 0) {
+		perror("temporary file");
+		exit(EXIT_ERROR);
+	}
+	xs->runs = realloc(xs->runs, (xs->nruns+1)*sizeof(FILE *));
+	if(!xs->runs) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	xs->runs[xs->nruns++] = f;
+	xs->n = 0;
+}
+
+static void xs_add(struct xsort *xs, const void *rec)
+{
+	if(!xs->buf) {
+		xs->buf = malloc(xs->cap*xs->rsize);
+		if(!xs->buf) {
+			perror("Out of memory");
+			exit(EXIT_ERROR);
+		}
+	}
+	if(xs->n == xs->cap)
+		xs_spill(xs);
+	memcpy(xs->buf + xs->n*xs->rsize, rec, xs->rsize);
+	xs->n++;
+	xs->total++;
+}
+
+/* heap of runs ordered by their next record */
+#define XS_HEAD(xs, i)	((xs)->heads + (xs)->heap[i]*(xs)->rsize)
+
+static void xs_down(struct xsort *xs, int i)
+{
+	for(;;) {
+		int c = 2*i+1, t;
+
+		if(c >= xs->nheap)
+			break;
+		if(c+1 < xs->nheap && xs->cmp(XS_HEAD(xs, c+1), XS_HEAD(xs, c)) < 0)
+			c++;
+		if(xs->cmp(XS_HEAD(xs, c), XS_HEAD(xs, i)) >= 0)
+			break;
+		t = xs->heap[i];
+		xs->heap[i] = xs->heap[c];
+		xs->heap[c] = t;
+		i = c;
+	}
+}
+
+/* done adding, get ready to read them back in order */
+static void xs_finish(struct xsort *xs)
+{
+	int i;
+
+	xs->next = 0;
+	if(!xs->nruns) {
+		qsort(xs->buf, xs->n, xs->rsize, xs->cmp);
+		return;
+	}
+	if(xs->n)
+		xs_spill(xs);
+	free(xs->buf);
+	xs->buf = NULL;
+	xs->heads = malloc(xs->nruns*xs->rsize);
+	xs->heap = malloc(xs->nruns*sizeof(int));
+	if(!xs->heads || !xs->heap) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i < xs->nruns; i++) {
+		rewind(xs->runs[i]);
+		if(fread(xs->heads + i*xs->rsize, xs->rsize, 1, xs->runs[i]) == 1)
+			xs->heap[xs->nheap++] = i;
+	}
+	for(i = xs->nheap/2-1; i >= 0; i--)
+		xs_down(xs, i);
+}
+
+/* next record in order, returns 0 at the end */
+static int xs_next(struct xsort *xs, void *rec)
+{
+	if(!xs->nruns) {
+		if(xs->next >= xs->n)
+			return 0;
+		memcpy(rec, xs->buf + xs->next++*xs->rsize, xs->rsize);
+		return 1;
+	}
+	if(!xs->nheap)
+		return 0;
+	memcpy(rec, XS_HEAD(xs, 0), xs->rsize);
+	if(fread(XS_HEAD(xs, 0), xs->rsize, 1, xs->runs[xs->heap[0]]) != 1) {
+		if(ferror(xs->runs[xs->heap[0]])) {
+			perror("temporary file");
+			exit(EXIT_ERROR);
+		}
+		xs->heap[0] = xs->heap[--xs->nheap];	/* that run's done */
+	}
+	xs_down(xs, 0);
+	return 1;
+}
+
+static void xs_free(struct xsort *xs)
+{
+	int i;
+
+	for(i = 0; i < xs->nruns; i++)
+		fclose(xs->runs[i]);
+	free(xs->runs);
+	free(xs->buf);
+	free(xs->heads);
+	free(xs->heap);
+	memset(xs, 0, sizeof(*xs));
+}
+
+#undef XS_HEAD
+
+/*
+ * When the patterns won't fit in --memory, they go into external
+ * sorts instead of array[] and array6[], and each input is matched
+ * by collecting its addresses and line offsets, as for --index, in
+ * another pair of sorts and merging them with the sorted patterns.
+ * The matching lines are sorted back into file order to print.
+ */
+static void go_external(void)
+{
+	unsigned int i;
+
+	xs_init(&xpat4, sizeof(struct netspec), netsort, memlimit/2);
+	xs_init(&xpat6, sizeof(struct netspec6), netsort6, memlimit/2);
+	for(i = 0; i < npatterns; i++)
+		xs_add(&xpat4, &array[i]);
+	for(i = 0; i < n6patterns; i++)
+		xs_add(&xpat6, &array6[i]);
+	for(i = 0; i < nruns6; i++) {
+		struct p6iter it = { &runs6[i] };
+
+		while(p6next(&it))
+			xs_add(&xpat6, &it.r);
+		pack6_free(&runs6[i]);
+	}
+	free(runs6);
+	runs6 = NULL;
+	nruns6 = 0;
+	runs6len = 0;
+	free(array);
+	free(array6);
+	array = NULL;
+	array6 = NULL;
+	npatterns = n6patterns = capacity = capacity6 = 0;
+	external = 1;
+}
+
+/* merge overlapping patterns as they come out of the sort, into a file */
+static void xpat_merge(void)
+{
+	struct netspec cur, next;
+	struct netspec6 cur6, next6;
+	int have = 0;
+
+	xs_finish(&xpat4);
+	xpat4f = xs_tmpfile();
+	while(xs_next(&xpat4, &next)) {
+		if(have && next.max <= cur.max)
+			continue;	/* contained within previous range */
+		if(have && next.min <= cur.max) {
+			cur.max = next.max;	/* overlapping, combine */
+			continue;
+		}
+		if(have) {
+			fwrite(&cur, sizeof(cur), 1, xpat4f);
+			xn4++;
+		}
+		cur = next;
+		have = 1;
+	}
+	if(have) {
+		fwrite(&cur, sizeof(cur), 1, xpat4f);
+		xn4++;
+	}
+	xs_free(&xpat4);
+
+	have = 0;
+	xs_finish(&xpat6);
+	xpat6f = xs_tmpfile();
+	while(xs_next(&xpat6, &next6)) {
+		if(have && v6cmp(next6.max, cur6.max) <= 0)
+			continue;
+		if(have && v6cmp(next6.min, cur6.max) <= 0) {
+			cur6.max = next6.max;
+			continue;
+		}
+		if(have) {
+			fwrite(&cur6, sizeof(cur6), 1, xpat6f);
+			xn6++;
+		}
+		cur6 = next6;
+		have = 1;
+	}
+	if(have) {
+		fwrite(&cur6, sizeof(cur6), 1, xpat6f);
+		xn6++;
+	}
+	xs_free(&xpat6);
+	if(fflush(xpat4f) != 0 || fflush(xpat6f) != 0) {
+		perror("temporary file");
+		exit(EXIT_ERROR);
+	}
+}
+
+/* match one input against the patterns on disk */
+static void xjoin(FILE *f, struct scanfile *sf)
+{
+	const char *fn = sf->fn? sf->fn: "(standard input)";
+	int quiet = counting || listfiles || silent;
+	struct xsort lines;
+	struct ix4 e4;
+	struct ix6 e6;
+	struct netspec pat;
+	struct netspec6 pat6;
+	struct stat st;
+	unsigned long long ln, cur = 0;
+	int got, hit = 0, have = 0;
+	FILE *in = f;
+	off_t end;
+	char *lp = NULL;
+	size_t lsize = 0;
+	ssize_t len;
+
+	if(fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) {
+		char buf[65536];	/* has to be read twice, keep a copy */
+		size_t n;
+
+		in = xs_tmpfile();
+		while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			if(fwrite(buf, 1, n, in) != n) {
+				perror("temporary file");
+				exit(EXIT_ERROR);
+			}
+		if(fflush(in) != 0 || fstat(fileno(in), &st) != 0) {
+			perror("temporary file");
+			exit(EXIT_ERROR);
+		}
+	}
+
+	/* every address in the file, sorted */
+	xs_init(&ixs4, sizeof(struct ix4), ix4sort, memlimit/3);
+	xs_init(&ixs6, sizeof(struct ix6), ix6sort, memlimit/3);
+	end = whole_lines(fileno(in), 0, st.st_size);
+	if(end > 0 && scan_map(fileno(in), 0, end, sf) < end) {
+		perror(fn);
+		exit(EXIT_ERROR);
+	}
+
+	/*
+	 * walk the addresses and patterns together, noting the line
+	 * of each address and whether it matched. For -v, addresses
+	 * count as in the scanner, if there are patterns of its type
+	 * or it's embedded v4.
+	 */
+	xs_init(&lines, sizeof(unsigned long long), linesort, memlimit/3);
+	xs_finish(&ixs4);
+	rewind(xpat4f);
+	got = fread(&pat, sizeof(pat), 1, xpat4f);
+	while(xs_next(&ixs4, &e4)) {
+		while(got && pat.max < e4.addr)
+			got = fread(&pat, sizeof(pat), 1, xpat4f);
+		hit = got && pat.min <= e4.addr;
+		if(hit || (invert && (xn4 || (e4.line & IX_EMBED)))) {
+			ln = (e4.line & ~IX_EMBED)<<1 | hit;
+			xs_add(&lines, &ln);
+		}
+	}
+	xs_free(&ixs4);
+	xs_finish(&ixs6);
+	rewind(xpat6f);
+	got = fread(&pat6, sizeof(pat6), 1, xpat6f);
+	while(xs_next(&ixs6, &e6)) {
+		while(got && v6cmp(pat6.max, e6.addr) < 0)
+			got = fread(&pat6, sizeof(pat6), 1, xpat6f);
+		hit = got && v6cmp(pat6.min, e6.addr) <= 0;
+		if(hit || (invert && (xn6 || (e6.line & IX_EMBED)))) {
+			ln = (e6.line & ~IX_EMBED)<<1 | hit;
+			xs_add(&lines, &ln);
+		}
+	}
+	xs_free(&ixs6);
+
+	/* then each line once, in order, matched if any address did */
+	xs_finish(&lines);
+	for(;;) {
+		got = xs_next(&lines, &ln);
+		if(have && got && ln>>1 == cur) {
+			hit |= ln & 1;
+			continue;
+		}
+		if(have && hit != invert) {
+			sf->nmatch++;
+			if(!quiet) {
+				if(fseeko(in, cur, SEEK_SET) != 0 || (len = getline(&lp, &lsize, in)) <= 0) {
+					perror(fn);
+					break;
+				}
+				print_line(sf, lp, len);
+			}
+			if(sf->nmatch >= stopafter) {
+				sf->stopped = 1;
+				break;
+			}
+		}
+		if(!got)
+			break;
+		cur = ln>>1;
+		hit = ln & 1;
+		have = 1;
+	}
+	xs_free(&lines);
+	free(lp);
+	if(in != f)
+		fclose(in);
+}
+
+/*
+ * --binary-input: fixed size records each holding a big-endian
+ * IPv4 or IPv6 address at some offset, as written by collectors.
+ * The addresses are pulled out and matched a batch at a time,
+ * and selected records are written as is, or as text with
+ * --text-output.
+ */
+static void scan_binary(int fd, struct scanfile *sf)
+{
+	size_t bufsize = recsize * BIN_BATCH * 16;
+	unsigned char *buf = malloc(bufsize);
+	size_t have = 0;
+	ssize_t n;
+
+	if(!buf) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(;;) {
+		n = read(fd, buf+have, bufsize-have);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror(sf->fn? sf->fn: "(standard input)");
+			break;
+		}
+		if(n == 0)
+			break;
+		have += n;
+		if(have >= recsize) {
+			size_t used = have - have%recsize;
+
+			if(bin_block(buf, used/recsize, sf)) {
+				sf->stopped = 1;	/* seen enough */
+				break;
+			}
+			memmove(buf, buf+used, have-used);
+			have -= used;
+		}
+	}
+	if(have && !sf->stopped)
+		fprintf(stderr, "%s: partial record at end ignored\n",
+			sf->fn? sf->fn: "(standard input)");
+	free(buf);
+}
+
+/* match nrec records, returns 1 if that's enough matches */
+static int bin_block(const unsigned char *buf, size_t nrec, struct scanfile *sf)
+{
+	int quiet = counting || listfiles || silent;
+	size_t i;
+
+	/* none of a family with no patterns, even with -v, as in text */
+	if((binaddr == 4 && !npatterns) || (binaddr == 6 && !n6patterns))
+		return 0;
+	for(i = 0; i < nrec; i += BIN_BATCH) {
+		unsigned char hit[BIN_BATCH];
+		const unsigned char *rp = buf + i*recsize;
+		const unsigned char *run = NULL;	/* adjacent selected records */
+		int n = (nrec-i < BIN_BATCH)? nrec-i: BIN_BATCH;
+		int k;
+
+		if(binaddr == 4) {
+			unsigned int a[BIN_BATCH];
+
+			for(k = 0; k < n; k++) {
+				const unsigned char *p = rp + k*recsize + recoff;
+
+				a[k] = (unsigned int)p[0]<<24 | p[1]<<16 | p[2]<<8 | p[3];
+			}
+			netmatch_batch(a, n, hit);
+		} else {
+			for(k = 0; k < n; k++) {
+				struct netspec6 r6;
+
+				memcpy(r6.min.a, rp + k*recsize + recoff, 16);
+				r6.max = r6.min;
+				hit[k] = netmatch6(r6);
+			}
+		}
+
+		for(k = 0; k < n; k++) {
+			const unsigned char *p = rp + k*recsize;
+
+			if(!hit[k] == !invert) {	/* not selected */
+				if(run) {
+					out_write(sf, (const char *)run, p-run);
+					run = NULL;
+				}
+				continue;
+			}
+			sf->nmatch++;
+			if(quiet)
+				;
+			else if(bintext) {
+				char tbuf[64];
+				int len;
+
+				if(binaddr == 4) {
+					unsigned int a = (unsigned int)p[recoff]<<24 | p[recoff+1]<<16
+						| p[recoff+2]<<8 | p[recoff+3];
+
+					len = fmt4(tbuf, a);
+				} else {
+					v6addr a6;
+
+					memcpy(a6.a, p+recoff, 16);
+					len = fmt6(tbuf, &a6);
+				}
+				tbuf[len++] = '\n';
+				print_line(sf, tbuf, len);
+			} else if(!run)
+				run = p;
+			if(sf->nmatch >= stopafter) {
+				if(run)
+					out_write(sf, (const char *)run, p+recsize-run);
+				return 1;
+			}
+		}
+		if(run)
+			out_write(sf, (const char *)run, rp+n*recsize-run);
+	}
+	return 0;
+}
+
+/*
+ * --pcap: the input is packet captures, classic pcap or pcapng,
+ * and a packet matches if its IPv4 or IPv6 source or destination
+ * does. Selected packets are summarized a line each, or written
+ * to another capture with --write-pcap.
+ * Ethernet, with VLAN tags, raw IP, BSD loopback, and Linux cooked
+ * captures are understood, other link types are skipped.
+ */
+#define LT_NULL		0		/* BSD loopback, 4 byte family */
+#define LT_ETHER	1
+#define LT_RAW		101		/* bare IPv4 or IPv6 */
+#define LT_SLL		113		/* Linux cooked */
+#define LT_IPV4		228
+#define LT_IPV6		229
+#define LT_SLL2		276
+#define PCAP_MAXIF	256		/* pcapng interfaces per section */
+
+/* get a 16 or 32 bit number in the capture's byte order */
+static unsigned int rd16(const unsigned char *p, int be)
+{
+	return be? p[0]<<8 | p[1]: p[1]<<8 | p[0];
+}
+
+static unsigned int rd32(const unsigned char *p, int be)
+{
+	return be? (unsigned int)p[0]<<24 | p[1]<<16 | p[2]<<8 | p[3]
+		: (unsigned int)p[3]<<24 | p[2]<<16 | p[1]<<8 | p[0];
+}
+
+/*
+ * find the IP header in a packet, skipping the link layer
+ * returns 4 or 6, or 0 if it's not IP or is too short
+ */
+static int pcap_ip(int linktype, const unsigned char *p, size_t len, const unsigned char **ip)
+{
+	size_t off;
+	unsigned int etype;
+
+	switch(linktype) {
+	case LT_ETHER:
+		off = 14;
+		if(len < off)
+			return 0;
+		etype = p[12]<<8 | p[13];
+		while((etype == 0x8100 || etype == 0x88a8 || etype == 0x9100) && len >= off+4) {
+			etype = p[off+2]<<8 | p[off+3];	/* VLAN tag */
+			off += 4;
+		}
+		break;
+	case LT_SLL:
+		off = 16;
+		if(len < off)
+			return 0;
+		etype = p[14]<<8 | p[15];
+		break;
+	case LT_SLL2:
+		off = 20;
+		if(len < off)
+			return 0;
+		etype = p[0]<<8 | p[1];
+		break;
+	case LT_NULL:
+	case LT_RAW:
+	case LT_IPV4:
+	case LT_IPV6:
+		off = (linktype == LT_NULL)? 4: 0;
+		if(len <= off)
+			return 0;
+		etype = ((p[off]>>4) == 4)? 0x0800: ((p[off]>>4) == 6)? 0x86dd: 0;
+		break;
+	default:
+		return 0;
+	}
+	*ip = p+off;
+	if(etype == 0x0800 && len >= off+20 && (p[off]>>4) == 4)
+		return 4;
+	if(etype == 0x86dd && len >= off+40 && (p[off]>>4) == 6)
+		return 6;
+	return 0;
+}
+
+/*
+ * frac/u of a second in microseconds, for any pcapng if_tsresol.
+ * frac*1000000 can overflow, so it's a decimal digit at a time,
+ * adding frac ten times modulo u to get the carry.
+ */
+static unsigned int frac_usec(unsigned long long frac, unsigned long long u)
+{
+	unsigned int usec = 0;
+	int i, j;
+
+	for(i = 0; i < 6; i++) {
+		unsigned long long r = 0;
+		unsigned int d = 0;
+
+		for(j = 0; j < 10; j++) {
+			if(r >= u - frac) {
+				r -= u - frac;
+				d++;
+			} else
+				r += frac;
+		}
+		usec = usec*10 + d;
+		frac = r;
+	}
+	return usec;
+}
+
+/* look at one packet, returns 1 if that's enough matches */
+static int pcap_packet(int linktype, long long sec, unsigned int usec,
+	const unsigned char *p, unsigned int caplen, unsigned int origlen, struct scanfile *sf)
+{
+	const unsigned char *ip;
+	int hit = 0;
+	int v = pcap_ip(linktype, p, caplen, &ip);
+
+	if(pcapout && pcaplink < 0)
+		pcap_header(linktype);
+	/* like a line with no address, or none of a family with no patterns */
+	if(!v || (v == 4 && !npatterns) || (v == 6 && !n6patterns))
+		return 0;
+	if(v == 4) {
+		struct netspec r;
+
+		r.min = r.max = (unsigned int)ip[12]<<24 | ip[13]<<16 | ip[14]<<8 | ip[15];
+		hit = netmatch(r);
+		if(!hit) {
+			r.min = r.max = (unsigned int)ip[16]<<24 | ip[17]<<16 | ip[18]<<8 | ip[19];
+			hit = netmatch(r);
+		}
+	} else {
+		struct netspec6 r6;
+
+		memcpy(r6.min.a, ip+8, 16);
+		r6.max = r6.min;
+		hit = netmatch6(r6);
+		if(!hit) {
+			memcpy(r6.min.a, ip+24, 16);
+			r6.max = r6.min;
+			hit = netmatch6(r6);
+		}
+	}
+	if(hit == invert)
+		return 0;
+
+	sf->nmatch++;
+	if(counting || listfiles || silent)
+		;
+	else if(pcapout)
+		pcap_write(linktype, sec, usec, p, caplen, origlen);
+	else {
+		char buf[160];
+		int len = sprintf(buf, "%lld.%06u IP%s ", sec, usec, (v == 4)? "": "6");
+
+		if(v == 4) {
+			len += fmt4(buf+len, (unsigned int)ip[12]<<24 | ip[13]<<16 | ip[14]<<8 | ip[15]);
+			len += sprintf(buf+len, " > ");
+			len += fmt4(buf+len, (unsigned int)ip[16]<<24 | ip[17]<<16 | ip[18]<<8 | ip[19]);
+			len += sprintf(buf+len, " proto %u length %u\n", ip[9], origlen);
+		} else {
+			len += fmt6(buf+len, (const v6addr *)(ip+8));
+			len += sprintf(buf+len, " > ");
+			len += fmt6(buf+len, (const v6addr *)(ip+24));
+			len += sprintf(buf+len, " proto %u length %u\n", ip[6], origlen);
+		}
+		print_line(sf, buf, len);
+	}
+	return sf->nmatch >= stopafter;
+}
+
+/* start the --write-pcap file, with the link type of the first packet */
+static void pcap_header(int linktype)
+{
+	struct {
+		unsigned int magic;
+		unsigned short major, minor;
+		int thiszone;
+		unsigned int sigfigs, snaplen, linktype;
+	} hdr = { 0xa1b2c3d4, 2, 4, 0, 0, 262144, 0 };
+
+	hdr.linktype = pcaplink = linktype;
+	fwrite(&hdr, sizeof(hdr), 1, pcapout);
+}
+
+/* write a selected packet to the --write-pcap file */
+static void pcap_write(int linktype, long long sec, unsigned int usec,
+	const unsigned char *p, unsigned int caplen, unsigned int origlen)
+{
+	static int warned = 0;
+	unsigned int rec[4];
+
+	if(linktype != pcaplink) {
+		if(!warned++)
+			fprintf(stderr, "Skipping packets with link type %d, the output is %d\n",
+				linktype, pcaplink);
+		return;
+	}
+	rec[0] = sec;
+	rec[1] = usec;
+	rec[2] = caplen;
+	rec[3] = origlen;
+	fwrite(rec, sizeof(rec), 1, pcapout);
+	fwrite(p, 1, caplen, pcapout);
+}
+
+/* classic pcap, returns 1 if it stopped early */
+static int pcap_classic(const unsigned char *buf, size_t len, struct scanfile *sf)
+{
+	int be = (buf[0] == 0xa1);
+	int nsec = (rd32(buf, be) == 0xa1b23c4d);
+	int linktype = rd32(buf+20, be) & 0xffff;
+	size_t off = 24;
+
+	while(off + 16 <= len) {
+		const unsigned char *h = buf+off;
+		unsigned int caplen = rd32(h+8, be);
+		unsigned int usec = rd32(h+4, be);
+
+		if(caplen > len-off-16)
+			break;
+		if(nsec)
+			usec /= 1000;
+		if(pcap_packet(linktype, rd32(h, be), usec, h+16, caplen, rd32(h+12, be), sf))
+			return 1;
+		off += 16 + caplen;
+	}
+	if(off != len)
+		fprintf(stderr, "%s: capture is truncated\n", sf->fn? sf->fn: "(standard input)");
+	return 0;
+}
+
+/* pcapng, a series of blocks, returns 1 if it stopped early */
+static int pcap_ng(const unsigned char *buf, size_t len, struct scanfile *sf)
+{
+	int be = 0;
+	int nif = 0;
+	int linktype[PCAP_MAXIF];
+	unsigned long long tsunits[PCAP_MAXIF];		/* ticks per second */
+	size_t off = 0;
+
+	while(off + 12 <= len) {
+		const unsigned char *b = buf+off;
+		unsigned int type, blen;
+
+		if(rd32(b, 0) == 0x0a0d0d0a) {		/* section header, maybe new byte order */
+			be = (b[8] == 0x1a);
+			nif = 0;
+		}
+		type = rd32(b, be);
+		blen = rd32(b+4, be);
+		if(blen < 12 || blen > len-off)
+			break;
+		if(type == 1 && blen >= 20 && nif < PCAP_MAXIF) {	/* interface */
+			const unsigned char *opt = b+16, *oend = b+blen-4;
+
+			linktype[nif] = rd16(b+8, be);
+			tsunits[nif] = 1000000;
+			while(opt+4 <= oend) {	/* look for if_tsresol */
+				unsigned int code = rd16(opt, be), olen = rd16(opt+2, be);
+
+				if(code == 0 || opt+4+olen > oend)
+					break;
+				if(code == 9 && olen >= 1) {
+					unsigned int r = opt[4] & 0x7f;
+					unsigned long long u = 1;
+
+					if(opt[4] & 0x80)
+						u = (r < 64)? 1ULL<<r: 0;
+					else
+						while(r-- > 0 && u <= ~0ULL/10)
+							u *= 10;
+					if(u)
+						tsunits[nif] = u;
+				}
+				opt += 4 + ((olen+3) & ~3);
+			}
+			nif++;
+		} else if((type == 6 || type == 2) && blen >= 32) {	/* enhanced or old packet */
+			unsigned int ifx = (type == 6)? rd32(b+8, be): rd16(b+8, be);
+			unsigned long long ts = (unsigned long long)rd32(b+12, be)<<32 | rd32(b+16, be);
+			unsigned int caplen = rd32(b+20, be);
+
+			if(ifx < nif && caplen <= blen-32) {
+				unsigned long long u = tsunits[ifx];
+				if(pcap_packet(linktype[ifx], ts/u, frac_usec(ts%u, u), b+28, caplen, rd32(b+24, be), sf))
+					return 1;
+			}
+		} else if(type == 3 && blen >= 16 && nif > 0) {	/* simple packet, interface 0 */
+			unsigned int origlen = rd32(b+8, be);
+			unsigned int caplen = (origlen < blen-16)? origlen: blen-16;
+
+			if(pcap_packet(linktype[0], 0, 0, b+12, caplen, origlen, sf))
+				return 1;
+		}
+		off += blen;
+	}
+	if(off != len)
+		fprintf(stderr, "%s: capture is truncated\n", sf->fn? sf->fn: "(standard input)");
+	return 0;
+}
+
+/*
+ * scan a capture, mapped if it's a file, otherwise read in
+ */
+static void scan_pcap(int fd, struct scanfile *sf)
+{
+	const char *fn = sf->fn? sf->fn: "(standard input)";
+	struct stat st;
+	unsigned char *buf = NULL;
+	size_t len = 0;
+	int mapped = 0;
+
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		len = st.st_size;
+		buf = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+		if(buf == MAP_FAILED)
+			buf = NULL;
+		else {
+			mapped = 1;
+			madvise(buf, len, MADV_SEQUENTIAL);
+		}
+	}
+	if(!mapped) {	/* a pipe, or map failed */
+		size_t size = 0;
+		ssize_t n;
+
+		len = 0;
+		for(;;) {
+			if(len == size) {
+				size = size? size*2: FOLLOW_CHUNK;
+				buf = realloc(buf, size);
+				if(!buf) {
+					perror("Out of memory");
+					exit(EXIT_ERROR);
+				}
+			}
+			n = read(fd, buf+len, size-len);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n < 0)
+				perror(fn);
+			if(n <= 0)
+				break;
+			len += n;
+		}
+	}
+
+	if(len >= 24 && (rd32(buf, 0) == 0xa1b2c3d4 || rd32(buf, 1) == 0xa1b2c3d4
+	   || rd32(buf, 0) == 0xa1b23c4d || rd32(buf, 1) == 0xa1b23c4d))
+		sf->stopped = pcap_classic(buf, len, sf);
+	else if(len >= 28 && rd32(buf, 0) == 0x0a0d0d0a)
+		sf->stopped = pcap_ng(buf, len, sf);
+	else if(len)
+		fprintf(stderr, "%s: not a pcap or pcapng capture\n", fn);
+
+	if(mapped)
+		munmap(buf, len);
+	else
+		free(buf);
+}
+
+/*
+ * --count-addresses counts each distinct matching address, or
+ * each /LEN with --by-prefix, in an open addressing hash table,
+ * to save piping the lines through grep -o, sort, and uniq -c.
+ * Worker threads have their own tables, merged at the end.
+ * If a table would grow past its share of --memory it turns into
+ * a Space-Saving sketch: a new address replaces the one with the
+ * smallest count and starts from that count. Any address seen
+ * more than total/entries times is kept, and each count is at
+ * most err too high.
+ */
+static unsigned int tally_hash(const v6addr *a, int v4)
+{
+	unsigned long long hi, lo;
+
+	memcpy(&hi, a->a, 8);
+	memcpy(&lo, a->a+8, 8);
+	hi = (hi*0x9e3779b97f4a7c15ULL) ^ lo ^ v4;
+	hi *= 0xff51afd7ed558ccdULL;
+	return hi >> 32;
+}
+
+/* the slot holding an address, or the empty one where it goes */
+static size_t tally_find(struct tally *tl, const v6addr *a, int v4, unsigned int h)
+{
+	size_t i = h & tl->mask;
+
+	while(tl->t[i].used && (tl->t[i].hash != h || tl->t[i].v4 != v4
+			|| v6cmp(tl->t[i].a, *a) != 0))
+		i = (i+1) & tl->mask;
+	return i;
+}
+
+static void tally_grow(struct tally *tl)
+{
+	struct tent *old = tl->t;
+	size_t oldsize = old? tl->mask+1: 0;
+	size_t size = old? oldsize*2: TALLY_INIT;
+	size_t i;
+
+	tl->t = calloc(size, sizeof(struct tent));
+	if(!tl->t) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	tl->mask = size-1;
+	for(i = 0; i < oldsize; i++)
+		if(old[i].used)
+			tl->t[tally_find(tl, &old[i].a, old[i].v4, old[i].hash)] = old[i];
+	free(old);
+}
+
+/* sift heap[i] down to its place by count */
+static void tally_down(struct tally *tl, size_t i)
+{
+	struct tent *t = tl->t;
+	unsigned int *hp = tl->heap;
+
+	for(;;) {
+		size_t c = 2*i+1, s = i;
+		unsigned int x;
+
+		if(c < tl->n && t[hp[c]].n < t[hp[s]].n)
+			s = c;
+		if(c+1 < tl->n && t[hp[c+1]].n < t[hp[s]].n)
+			s = c+1;
+		if(s == i)
+			break;
+		x = hp[i]; hp[i] = hp[s]; hp[s] = x;
+		t[hp[i]].pos = i;
+		t[hp[s]].pos = s;
+		i = s;
+	}
+}
+
+/* full and can't grow, keep the rest in a heap by count */
+static void tally_sketch(struct tally *tl)
+{
+	size_t i, n = 0;
+
+	tl->heap = malloc((tl->mask+1) * sizeof(unsigned int));
+	if(!tl->heap) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	for(i = 0; i <= tl->mask; i++)
+		if(tl->t[i].used) {
+			tl->t[i].pos = n;
+			tl->heap[n++] = i;
+		}
+	for(i = n/2; i-- > 0; )
+		tally_down(tl, i);
+}
+
+/* empty slot i, moving later entries back so they can still be found */
+static void tally_del(struct tally *tl, size_t i)
+{
+	struct tent *t = tl->t;
+	size_t j = i, k;
+
+	for(;;) {
+		j = (j+1) & tl->mask;
+		if(!t[j].used)
+			break;
+		k = t[j].hash & tl->mask;	/* where it wants to be */
+		if(i <= j? (i < k && k <= j): (i < k || k <= j))
+			continue;		/* still reachable from there */
+		t[i] = t[j];
+		if(tl->heap)
+			tl->heap[t[i].pos] = i;
+		i = j;
+	}
+	t[i].used = 0;
+}
+
+/* add n to an address's count, err of it possibly others' */
+static void tally_add(struct tally *tl, const v6addr *a, int v4,
+	unsigned long long n, unsigned long long err)
+{
+	unsigned int h = tally_hash(a, v4);
+	size_t i;
+
+	if(!tl->t)
+		tally_grow(tl);
+	i = tally_find(tl, a, v4, h);
+	if(!tl->t[i].used && tl->n >= tl->mask+1 - (tl->mask+1)/4) {	/* full */
+		if(!tl->heap && (tl->mask+1)*2*(sizeof(struct tent)+sizeof(unsigned int)) <= tl->budget) {
+			tally_grow(tl);
+			i = tally_find(tl, a, v4, h);
+		} else {	/* replace the smallest */
+			unsigned long long min;
+
+			if(!tl->heap)
+				tally_sketch(tl);
+			min = tl->t[tl->heap[0]].n;
+			tally_del(tl, tl->heap[0]);
+			i = tally_find(tl, a, v4, h);
+			tl->t[i].a = *a;
+			tl->t[i].v4 = v4;
+			tl->t[i].used = 1;
+			tl->t[i].hash = h;
+			tl->t[i].pos = 0;
+			tl->t[i].n = min + n;
+			tl->t[i].err = min + err;
+			tl->heap[0] = i;
+			tally_down(tl, 0);
+			return;
+		}
+	}
+	if(tl->t[i].used) {
+		tl->t[i].n += n;
+		tl->t[i].err += err;
+		if(tl->heap)
+			tally_down(tl, tl->t[i].pos);
+		return;
+	}
+	tl->t[i].a = *a;
+	tl->t[i].v4 = v4;
+	tl->t[i].used = 1;
+	tl->t[i].hash = h;
+	tl->t[i].n = n;
+	tl->t[i].err = err;
+	tl->n++;
+}
+
+/* called from the scanner for each address counted */
+static void tally4(struct scanfile *sf, unsigned int addr)
+{
+	v6addr a;
+
+	if(bypfx4 < 32)
+		addr &= ~(0xffffffffU >> bypfx4);
+	memset(a.a, 0, 12);
+	a.a[12] = addr >> 24;
+	a.a[13] = addr >> 16;
+	a.a[14] = addr >> 8;
+	a.a[15] = addr;
+	tally_add(sf->tl? sf->tl: &tally, &a, 1, 1, 0);
+	sf->nmatch++;
+}
+
+static void tally6(struct scanfile *sf, const v6addr *addr)
+{
+	struct netspec6 spec;
+
+	applymask6(*addr, bypfx6, &spec);
+	tally_add(sf->tl? sf->tl: &tally, &spec.min, 0, 1, 0);
+	sf->nmatch++;
+}
+
+/* add a thread's table to the main one */
+static void tally_merge(struct tally *from)
+{
+	size_t i;
+
+	if(!from->t)
+		return;
+	for(i = 0; i <= from->mask; i++)
+		if(from->t[i].used)
+			tally_add(&tally, &from->t[i].a, from->t[i].v4, from->t[i].n, from->t[i].err);
+	free(from->t);
+	free(from->heap);
+}
+
+/* biggest count first, then v4 before v6, then by address */
+static int tentsort(const void *a, const void *b)
+{
+	const struct tent *ta = a, *tb = b;
+
+	if(ta->n != tb->n)
+		return (ta->n < tb->n)? 1: -1;
+	if(ta->v4 != tb->v4)
+		return tb->v4 - ta->v4;
+	return v6cmp(ta->a, tb->a);
+}
+
+/* print the counts like uniq -c */
+static void tally_print(void)
+{
+	struct tent *t = tally.t;
+	unsigned long long maxerr = 0;
+	size_t i, n = 0;
+
+	if(!t)
+		return;
+	for(i = 0; i <= tally.mask; i++)	/* squeeze out the empty slots */
+		if(t[i].used)
+			t[n++] = t[i];
+	qsort(t, n, sizeof(struct tent), tentsort);
+	if(topk && topk < n)
+		n = topk;
+	for(i = 0; i < n; i++) {
+		char buf[64];
+		int len;
+
+		if(t[i].v4) {
+			len = fmt4(buf, (t[i].a.a[12]<<24)|(t[i].a.a[13]<<16)|(t[i].a.a[14]<<8)|t[i].a.a[15]);
+			if(bypfx4 < 32)
+				sprintf(buf+len, "/%d", bypfx4);
+		} else {
+			len = fmt6(buf, &t[i].a);
+			if(bypfx6 < 128)
+				sprintf(buf+len, "/%d", bypfx6);
+		}
+		printf("%7llu %s\n", t[i].n, buf);
+		if(t[i].err > maxerr)
+			maxerr = t[i].err;
+	}
+	if(tally.heap)
+		fprintf(stderr, "Too many addresses to count in --memory, counts may be up to %llu too high\n",
+			maxerr);
+	free(tally.t);
+	free(tally.heap);
+	tally.t = NULL;
+}
+
+/*
+ * --rewrite passes all the text through, replacing each matching
+ * address with its first --rewrite-prefix bits and the rest zero,
+ * or with --rewrite-key, the rest from a SipHash-2-4 of the whole
+ * address, so each address gets the same stand-in every time but
+ * it can't be reversed without the key. The text between addresses
+ * is printed straight from the input, and when mapped it can go out
+ * by zero-copy like selected lines.
+ */
+#define ROTL(x, b)	(((x) << (b)) | ((x) >> (64-(b))))
+#define SIPROUND	do { \
+	v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+	v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while(0)
+
+static unsigned long long siphash(const unsigned char *m, size_t len)
+{
+	unsigned long long v0 = 0x736f6d6570736575ULL ^ rwkey[0];
+	unsigned long long v1 = 0x646f72616e646f6dULL ^ rwkey[1];
+	unsigned long long v2 = 0x6c7967656e657261ULL ^ rwkey[0];
+	unsigned long long v3 = 0x7465646279746573ULL ^ rwkey[1];
+	unsigned long long b = (unsigned long long)len << 56, w;
+	size_t i;
+	int j;
+
+	for(i = 0; i+8 <= len; i += 8) {
+		for(w = 0, j = 7; j >= 0; j--)	/* little-endian words */
+			w = (w<<8) | m[i+j];
+		v3 ^= w;
+		SIPROUND; SIPROUND;
+		v0 ^= w;
+	}
+	for(j = 0; i+j < len; j++)
+		b |= (unsigned long long)m[i+j] << (8*j);
+	v3 ^= b;
+	SIPROUND; SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+#undef ROTL
+
+/* the key is the first 16 bytes of the file */
+static void rewrite_key(const char *fn)
+{
+	unsigned char k[16];
+	FILE *f = fopen(fn, "r");
+	int i;
+
+	if(!f) {
+		perror(fn);
+		exit(EXIT_ERROR);
+	}
+	if(fread(k, 1, 16, f) != 16) {
+		fprintf(stderr, "%s: a key needs 16 bytes\n", fn);
+		exit(EXIT_ERROR);
+	}
+	fclose(f);
+	for(i = 7; i >= 0; i--) {
+		rwkey[0] = (rwkey[0]<<8) | k[i];
+		rwkey[1] = (rwkey[1]<<8) | k[i+8];
+	}
+	rwkeyed = 1;
+}
+
+/* print the text up to an address, and what replaces it */
+static char *rewrite_out(struct scanfile *sf, char *cp, char *from, char *to,
+	const char *buf, int len)
+{
+	print_span(sf, cp, from-cp);
+	if(sf->zc)
+		zc_flush(sf);	/* so it stays in order */
+	out_write(sf, buf, len);
+	sf->nmatch++;
+	return to;
+}
+
+/* called from the scanner for an address in from..to */
+static char *rewrite4(struct scanfile *sf, char *cp, char *from, char *to, unsigned int addr)
+{
+	unsigned int keep = rw4? ~0U << (32-rw4): 0;
+	unsigned int rest = 0;
+	char buf[20];
+
+	if(rwkeyed) {
+		unsigned char m[5];
+
+		m[0] = 4;
+		m[1] = addr >> 24;
+		m[2] = addr >> 16;
+		m[3] = addr >> 8;
+		m[4] = addr;
+		rest = siphash(m, 5);
+	}
+	return rewrite_out(sf, cp, from, to, buf, fmt4(buf, (addr & keep) | (rest & ~keep)));
+}
+
+static char *rewrite6(struct scanfile *sf, char *cp, char *from, char *to, const v6addr *addr)
+{
+	static const unsigned char mapped[12] = { 0,0,0,0,0,0,0,0,0,0,255,255 };
+	unsigned char m[18];
+	unsigned long long rest[2] = { 0, 0 };
+	int bits = rw6;		/* to keep */
+	v6addr r;
+	char buf[64];
+	int i;
+
+	if(memcmp(addr->a, mapped, 12) == 0)	/* really v4 */
+		bits = 96 + rw4;
+	if(rwkeyed) {
+		m[0] = 6;
+		memcpy(m+1, addr->a, 16);
+		m[17] = 0;
+		rest[0] = siphash(m, 18);
+		m[17] = 1;
+		rest[1] = siphash(m, 18);
+	}
+	for(i = 0; i < 16; i++) {
+		int k = bits - 8*i;
+		unsigned char mask = (k >= 8)? 0xff: (k <= 0)? 0: 0xff << (8-k);
+
+		r.a[i] = (addr->a[i] & mask) | ((rest[i/8] >> (8*(i%8))) & ~mask);
+	}
+	return rewrite_out(sf, cp, from, to, buf, fmt6(buf, &r));
+}
+
+/*
+ * --json prints a line of JSON for each matching address, with
+ * where it is and the pattern it matched as it was given.
+ * The merged ranges have lost the patterns, so for each family
+ * there's a list of segments of the address space, each with the
+ * most specific pattern covering it, found with a binary search.
+ * Records are put together by hand in a buffer on the stack and
+ * added to the output in one piece.
+ */
+struct jpat {
+	struct netspec6 r;	/* v4 in the low 32 bits */
+	v6addr size;		/* max-min, smaller is more specific */
+	char *text;
+};
+
+struct jseg {
+	v6addr min;		/* segment runs to the next one's min */
+	const char *text;	/* NULL if no pattern covers it */
+};
+
+static struct jpat *jpats[2];	/* patterns as given, v4 and v6 */
+static size_t njpats[2], capjpats[2];
+static struct jseg *jsegs[2];
+static size_t njsegs[2];
+
+/* remember a pattern's text, from load_patterns() */
+static void json_pattern(const char *text, const v6addr *min, const v6addr *max, int v6)
+{
+	struct jpat *jp;
+	size_t len;
+	int i, borrow = 0;
+
+	/* just the pattern, not a comment after it, but a v4 range may have
+	   white space around its dash */
+	while(isspace((unsigned char)*text))
+		text++;
+	len = strcspn(text, " \t\r\n\v\f");
+	if(!v6 && !memchr(text, '-', len) && text[len + strspn(text+len, " \t")] == '-')
+		len += strspn(text+len, " \t") + 1;
+	if(!v6 && len && text[len-1] == '-') {
+		len += strspn(text+len, " \t");
+		len += strcspn(text+len, " \t\r\n\v\f");
+	}
+	if(njpats[v6] == capjpats[v6]) {
+		capjpats[v6] = capjpats[v6]? capjpats[v6]*2: INIT_NETWORKS;
+		jpats[v6] = realloc(jpats[v6], capjpats[v6]*sizeof(struct jpat));
+	}
+	if(!jpats[v6] || !(jpats[v6][njpats[v6]].text = malloc(len+1))) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	jp = &jpats[v6][njpats[v6]++];
+	memcpy(jp->text, text, len);
+	jp->text[len] = 0;
+	jp->r.min = *min;
+	jp->r.max = *max;
+	for(i = 15; i >= 0; i--) {
+		int d = max->a[i] - min->a[i] - borrow;
+
+		borrow = d < 0;
+		jp->size.a[i] = d;
+	}
+}
+
+static void json_pattern4(const char *text, const struct netspec *spec)
+{
+	v6addr min, max;
+	int b;
+
+	memset(&min, 0, sizeof(min));
+	memset(&max, 0, sizeof(max));
+	for(b = 0; b < 4; b++) {
+		min.a[12+b] = spec->min >> (24-8*b);
+		max.a[12+b] = spec->max >> (24-8*b);
+	}
+	json_pattern(text, &min, &max, 0);
+}
+
+static int jpatsort(const void *a, const void *b)
+{
+	return v6cmp(((const struct jpat *)a)->r.min, ((const struct jpat *)b)->r.min);
+}
+
+static int v6sort(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(v6addr));
+}
+
+/*
+ * sweep the sorted patterns, with the ones covering the current
+ * point in a heap by size, to find the most specific one for
+ * each stretch between pattern ends
+ */
+static void json_build(int v6)
+{
+	struct jpat *jp = jpats[v6];
+	size_t n = njpats[v6], npts = 0, nheap = 0, i, j, x = 0;
+	v6addr *pts = malloc((2*n+1) * sizeof(v6addr));
+	size_t *heap = malloc((n+1) * sizeof(size_t));
+	struct jseg *seg = malloc((2*n+1) * sizeof(struct jseg));
+
+	if(!pts || !heap || !seg) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	qsort(jp, n, sizeof(struct jpat), jpatsort);
+	for(i = 0; i < n; i++) {
+		static const v6addr ones = {{ 255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255 }};
+
+		pts[npts++] = jp[i].r.min;
+		if(v6cmp(jp[i].r.max, ones) != 0) {
+			pts[npts] = jp[i].r.max;
+			v6inc(&pts[npts++]);
+		}
+	}
+	qsort(pts, npts, sizeof(v6addr), v6sort);
+	jsegs[v6] = seg;
+	njsegs[v6] = 0;
+	for(i = 0; i < npts; i++) {
+		const char *text;
+
+		if(i && v6cmp(pts[i], pts[i-1]) == 0)
+			continue;
+		while(x < n && v6cmp(jp[x].r.min, pts[i]) <= 0) {	/* add, sift up */
+			for(j = nheap++; j > 0 && v6cmp(jp[x].size, jp[heap[(j-1)/2]].size) < 0; j = (j-1)/2)
+				heap[j] = heap[(j-1)/2];
+			heap[j] = x++;
+		}
+		while(nheap && v6cmp(jp[heap[0]].r.max, pts[i]) < 0) {	/* ended, sift down */
+			size_t last = heap[--nheap];
+
+			for(j = 0; 2*j+1 < nheap; ) {
+				size_t c = 2*j+1;
+
+				if(c+1 < nheap && v6cmp(jp[heap[c+1]].size, jp[heap[c]].size) < 0)
+					c++;
+				if(v6cmp(jp[heap[c]].size, jp[last].size) >= 0)
+					break;
+				heap[j] = heap[c];
+				j = c;
+			}
+			heap[j] = last;
+		}
+		text = nheap? jp[heap[0]].text: NULL;
+		if(!njsegs[v6] || seg[njsegs[v6]-1].text != text) {
+			seg[njsegs[v6]].min = pts[i];
+			seg[njsegs[v6]++].text = text;
+		}
+	}
+	free(pts);
+	free(heap);
+}
+
+/* the pattern for an address */
+static const char *json_find(const v6addr *a, int v6)
+{
+	struct jseg *seg = jsegs[v6];
+	size_t lo = 0, hi = njsegs[v6];
+
+	while(hi - lo > 1) {	/* last one starting at or before a */
+		size_t mid = (lo+hi)/2;
+
+		if(v6cmp(seg[mid].min, *a) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (hi && v6cmp(seg[lo].min, *a) <= 0)? seg[lo].text: NULL;
+}
+
+/*
+ * newlines from q up to end, 16 bytes at a time with SSE2,
+ * adding up the compares in bytes and those every 255 loads
+ */
+static unsigned long long count_nl(const char *q, const char *end)
+{
+	unsigned long long n = 0;
+
+#ifdef __SSE2__
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	while(end - q >= 16) {
+		__m128i acc = _mm_setzero_si128();
+		int i;
+
+		for(i = 0; i < 255 && end - q >= 16; i++, q += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)q), nl));
+		acc = _mm_sad_epu8(acc, _mm_setzero_si128());
+		n += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	}
+#endif
+	while(q < end && (q = memchr(q, '\n', end-q)) != NULL) {
+		n++;
+		q++;
+	}
+	return n;
+}
+
+/*
+ * count newlines in the block being scanned up to upto, only when a
+ * line number is needed, so sparse matches skip over most lines in bulk
+ */
+static void count_lines(struct scanfile *sf, const char *upto)
+{
+	sf->lineno += count_nl(sf->bp + (sf->lnoff - sf->boff), upto);
+	sf->lnoff = sf->boff + (upto - sf->bp);
+}
+
+/* newlines in a file before end, when not scanning from the start */
+static unsigned long long lines_before(int fd, off_t end)
+{
+	char buf[65536];
+	unsigned long long n = 0;
+	off_t pos = 0;
+
+	while(pos < end) {
+		ssize_t len = pread(fd, buf, (end-pos < sizeof(buf))? end-pos: sizeof(buf), pos);
+
+		if(len <= 0)
+			break;
+		n += count_nl(buf, buf+len);
+		pos += len;
+	}
+	return n;
+}
+
+/* a record being put together */
+struct jout {
+	struct scanfile *sf;
+	size_t n;
+	char b[1024];
+};
+
+static void jo_put(struct jout *jo, const char *p, size_t len)
+{
+	if(jo->n + len > sizeof(jo->b)) {
+		out_write(jo->sf, jo->b, jo->n);
+		jo->n = 0;
+		if(len > sizeof(jo->b)) {
+			out_write(jo->sf, p, len);
+			return;
+		}
+	}
+	memcpy(jo->b + jo->n, p, len);
+	jo->n += len;
+}
+
+static void jo_str(struct jout *jo, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *run = s;
+
+	jo_put(jo, "\"", 1);
+	for(; *s; s++) {
+		unsigned char c = *s;
+		char esc[6] = { '\\', 'u', '0', '0', hex[c>>4], hex[c&15] };
+
+		if(c >= ' ' && c != '"' && c != '\\')
+			continue;
+		jo_put(jo, run, s-run);
+		run = s+1;
+		if(c == '"' || c == '\\') {
+			esc[1] = c;
+			jo_put(jo, esc, 2);
+		} else
+			jo_put(jo, esc, 6);
+	}
+	jo_put(jo, run, s-run);
+	jo_put(jo, "\"", 1);
+}
+
+static void jo_num(struct jout *jo, unsigned long long v)
+{
+	char b[24];
+	int i = sizeof(b);
+
+	do
+		b[--i] = '0' + v%10;
+	while(v /= 10);
+	jo_put(jo, b+i, sizeof(b)-i);
+}
+
+#define JO_LIT(jo, s)	jo_put(jo, s, sizeof(s)-1)
+
+/* called from the scanner for a matching address in from..to on line lp */
+static void json_out(struct scanfile *sf, const char *lp, const char *from, const char *to,
+	const v6addr *a, int v6)
+{
+	struct jout jo;
+	const char *pat = json_find(a, v6);
+
+	count_lines(sf, lp);
+	jo.sf = sf;
+	jo.n = 0;
+	JO_LIT(&jo, "{\"file\":");
+	if(sf->fn)
+		jo_str(&jo, sf->fn);
+	else
+		JO_LIT(&jo, "null");
+	JO_LIT(&jo, ",\"offset\":");
+	jo_num(&jo, sf->boff + (from - sf->bp));
+	JO_LIT(&jo, ",\"line\":");
+	jo_num(&jo, sf->lineno + 1);
+	JO_LIT(&jo, ",\"address\":\"");
+	jo_put(&jo, from, to-from);
+	if(v6)
+		JO_LIT(&jo, "\",\"family\":6,\"pattern\":");
+	else
+		JO_LIT(&jo, "\",\"family\":4,\"pattern\":");
+	if(pat)
+		jo_str(&jo, pat);
+	else
+		JO_LIT(&jo, "null");
+	JO_LIT(&jo, "}\n");
+	out_write(sf, jo.b, jo.n);
+	sf->nmatch++;
+}
+
+#undef JO_LIT
+
+static void json4(struct scanfile *sf, const char *lp, const char *from, const char *to, unsigned int addr)
+{
+	v6addr a;
+
+	memset(a.a, 0, 12);
+	a.a[12] = addr >> 24;
+	a.a[13] = addr >> 16;
+	a.a[14] = addr >> 8;
+	a.a[15] = addr;
+	json_out(sf, lp, from, to, &a, 0);
+}
+
+static void json6(struct scanfile *sf, const char *lp, const char *from, const char *to, const v6addr *addr)
+{
+	json_out(sf, lp, from, to, addr, 1);
+}
+
+/*
+ * --profile counts cycles, instructions, branch misses, and
+ * last level cache misses in each thread with perf_event_open(),
+ * and wall time with clock_gettime(), by phase: loading and
+ * sorting the patterns, scan_block(), lookups, and output.
+ * Reading the counters costs far more than a lookup, so rather
+ * than time lookups in place, every PROF_EVERY'th is kept, and
+ * when there are PROF_KEYS of them they're done again between
+ * blocks and timed together. The cost of all the lookups is
+ * estimated from that and taken out of the scan. Lines read one
+ * at a time from a pipe are timed in runs for the same reason.
+ * Output from the scanner is saved and written after the block,
+ * so it can be timed on its own. Counters are read with rdpmc
+ * where the kernel allows, else with read(), and if there are
+ * none it's times only.
+ */
+static int pmc_read(struct perf_event_mmap_page *pg, unsigned long long *val)
+{
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned int seq, idx, lo, hi;
+	unsigned long long cnt;
+	long long pmc;
+
+	do {
+		seq = pg->lock;
+		__asm__ volatile("" ::: "memory");
+		idx = pg->index;
+		if(!pg->cap_user_rdpmc || !idx)
+			return 0;	/* not on a counter just now */
+		cnt = pg->offset;
+		__asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx-1));
+		pmc = ((unsigned long long)hi << 32 | lo) << (64 - pg->pmc_width);
+		cnt += pmc >> (64 - pg->pmc_width);	/* sign extended */
+		__asm__ volatile("" ::: "memory");
+	} while(pg->lock != seq);
+	*val = cnt;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* the clock and counters now */
+static void prof_read(struct prof *pf, unsigned long long *v)
+{
+	struct timespec ts;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	v[0] = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#ifdef __linux__
+	if(!pf->nctr)
+		return;
+	for(i = 0; i < NCTR; i++)
+		if(!pf->pg[i] || !pmc_read(pf->pg[i], &v[1+i]))
+			break;
+	if(i < NCTR) {	/* all at once from the group leader */
+		unsigned long long buf[1+NCTR];
+
+		if(read(pf->fd[0], buf, sizeof(buf)) == sizeof(buf))
+			memcpy(&v[1], &buf[1], NCTR*sizeof(buf[0]));
+	}
+#endif
+}
+
+/* add what happened since v to phase ph, scaled by num/den */
+static void prof_add(struct prof *pf, int ph, const unsigned long long *v,
+	unsigned long long num, unsigned long long den)
+{
+	unsigned long long now[NPV];
+	int i;
+
+	prof_read(pf, now);
+	for(i = 0; i < NPV; i++) {
+		unsigned long long d = now[i] - v[i];
+
+		if(ph != PH_CAL)	/* less what reading costs */
+			d = (d > pf->ovh[i])? d - pf->ovh[i]: 0;
+		pf->sum[ph][i] += (double)d * num / den;
+	}
+}
+
+static void prof_init(struct prof *pf)
+{
+#ifdef __linux__
+	static const unsigned long long evs[NCTR] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+	};
+	long pgsize = sysconf(_SC_PAGESIZE);
+#endif
+	unsigned long long v[NPV];
+	int i;
+
+	memset(pf, 0, sizeof(*pf));
+	pf->cur = -1;
+	pf->err = ENOSYS;
+	pf->k4 = malloc(PROF_KEYS * sizeof(struct netspec));
+	pf->k6 = malloc(PROF_KEYS * sizeof(struct netspec6));
+	if(!pf->k4 || !pf->k6) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+#ifdef __linux__
+	for(i = 0; i < NCTR; i++) {
+		struct perf_event_attr attr;
+		void *pg;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = evs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;	/* all that's allowed unprivileged */
+		attr.exclude_hv = 1;
+		pf->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i? pf->fd[0]: -1, 0);
+		if(pf->fd[i] < 0) {
+			pf->err = errno;
+			while(--i >= 0) {
+				if(pf->pg[i])
+					munmap(pf->pg[i], pgsize);
+				close(pf->fd[i]);
+			}
+			memset(pf->pg, 0, sizeof(pf->pg));
+			break;
+		}
+		pg = mmap(NULL, pgsize, PROT_READ, MAP_SHARED, pf->fd[i], 0);
+		pf->pg[i] = (pg == MAP_FAILED)? NULL: pg;
+	}
+	if(i == NCTR)
+		pf->nctr = NCTR;
+#endif
+	/* what a reading costs, the least of a few */
+	for(i = 0; i < NPV; i++)
+		pf->ovh[i] = ~0ULL;
+	for(i = 0; i < 64; i++) {
+		int j;
+
+		memset(pf->sum[PH_CAL], 0, sizeof(pf->sum[PH_CAL]));
+		prof_read(pf, v);
+		prof_add(pf, PH_CAL, v, 1, 1);
+		for(j = 0; j < NPV; j++)
+			if(pf->sum[PH_CAL][j] < pf->ovh[j])
+				pf->ovh[j] = pf->sum[PH_CAL][j];
+	}
+}
+
+/* a worker's figures into the main ones */
+static void prof_merge(struct prof *pf)
+{
+	int ph, i;
+
+	prof_replay(pf);
+	for(ph = 0; ph < PH_CAL; ph++) {
+		prof.calls[ph] += pf->calls[ph];
+		for(i = 0; i < NPV; i++)
+			prof.sum[ph][i] += pf->sum[ph][i];
+	}
+	prof.bytes += pf->bytes;
+#ifdef __linux__
+	for(i = 0; i < pf->nctr; i++) {
+		if(pf->pg[i])
+			munmap(pf->pg[i], sysconf(_SC_PAGESIZE));
+		close(pf->fd[i]);
+	}
+#endif
+	free(pf->k4);
+	free(pf->k6);
+}
+
+/* in the main thread, end the current phase and start ph, or none for -1 */
+static void prof_mark(int ph)
+{
+	if(!profiling)
+		return;
+	if(prof.cur >= 0)
+		prof_add(&prof, prof.cur, prof.mark, 1, 1);
+	prof.cur = ph;
+	if(ph >= 0) {
+		prof.calls[ph]++;
+		prof_read(&prof, prof.mark);
+	}
+}
+
+/* do the kept lookups again, to see what all the lookups cost */
+static void prof_replay(struct prof *pf)
+{
+	unsigned long long v[NPV];
+	unsigned int hits = 0;
+	int i;
+
+	if(pf->nk4) {
+		prof_read(pf, v);
+		for(i = 0; i < pf->nk4; i++)
+			hits += netmatch(pf->k4[i]);
+		prof_add(pf, PH_LOOKUP, v, pf->pend4, pf->nk4);
+		pf->nk4 = 0;
+		pf->pend4 = 0;
+	}
+	if(pf->nk6) {
+		prof_read(pf, v);
+		for(i = 0; i < pf->nk6; i++)
+			hits += netmatch6(pf->k6[i]);
+		prof_add(pf, PH_LOOKUP, v, pf->pend6, pf->nk6);
+		pf->nk6 = 0;
+		pf->pend6 = 0;
+	}
+	pf->sink += hits;
+}
+
+/* end a measurement of the scan, and write out what it saved */
+static void prof_flush(struct scanfile *sf)
+{
+	struct prof *pf = PROF(sf);
+	unsigned long long v[NPV];
+
+	if(!pf->run)
+		return;
+	prof_add(pf, PH_SCAN, pf->runv, 1, 1);
+	pf->run = 0;
+	if(pf->nk4 == PROF_KEYS || pf->nk6 == PROF_KEYS)
+		prof_replay(pf);
+	if(sf->jobx < 0 && sf->out.len) {
+		pf->calls[PH_OUTPUT]++;
+		prof_read(pf, v);
+		fwrite(sf->out.buf, 1, sf->out.len, stdout);
+		prof_add(pf, PH_OUTPUT, v, 1, 1);
+		sf->out.len = 0;
+	}
+}
+
+/* scan_block() when profiling, small blocks timed a run at a time */
+static int scan_prof(char *bp, size_t blen, struct scanfile *sf)
+{
+	struct prof *pf = PROF(sf);
+	int r;
+
+	if(!pf->run)
+		prof_read(pf, pf->runv);
+	pf->calls[PH_SCAN]++;
+	pf->bytes += blen;
+	pf->inscan = 1;
+	r = scan_inner(bp, blen, sf);
+	pf->inscan = 0;
+	if(++pf->run >= PROF_EVERY || blen >= PROF_BIG || r)
+		prof_flush(sf);
+	return r;
+}
+
+static int prof_lookup4(struct scanfile *sf, const struct netspec r)
+{
+	struct prof *pf = PROF(sf);
+
+	pf->calls[PH_LOOKUP]++;
+	pf->pend4++;
+	if(++pf->nl4 % PROF_EVERY == 0 && pf->nk4 < PROF_KEYS)
+		pf->k4[pf->nk4++] = r;
+	return netmatch(r);
+}
+
+static int prof_lookup6(struct scanfile *sf, const struct netspec6 r)
+{
+	struct prof *pf = PROF(sf);
+
+	pf->calls[PH_LOOKUP]++;
+	pf->pend6++;
+	if(++pf->nl6 % PROF_EVERY == 0 && pf->nk6 < PROF_KEYS)
+		pf->k6[pf->nk6++] = r;
+	return netmatch6(r);
+}
+
+static void prof_row(const char *name, unsigned long long calls, const double *v)
+{
+	double bytes = prof.bytes? prof.bytes: 1;
+
+	fprintf(stderr, "%-8s %12llu %10.2f %8.3f", name, calls, v[0]/1e6, v[0]/bytes);
+	if(prof.nctr)
+		fprintf(stderr, " %9.3f %6.2f %11.3f %12.3f",
+			v[1]/bytes, v[1]? v[2]/v[1]: 0,
+			v[2]? v[3]*1000/v[2]: 0, v[2]? v[4]*1000/v[2]: 0);
+	fprintf(stderr, "\n");
+}
+
+/* the table, at exit */
+static void prof_print(void)
+{
+	static const char *const names[] = { "load", "sort", "scan", "lookup", "output" };
+	double scan[NPV];
+	int ph, i;
+
+	prof_mark(-1);
+	prof_replay(&prof);
+	for(i = 0; i < NPV; i++) {	/* the scan, less its lookups */
+		scan[i] = prof.sum[PH_SCAN][i] - prof.sum[PH_LOOKUP][i];
+		if(scan[i] < 0)
+			scan[i] = 0;
+	}
+	fflush(stdout);
+	fprintf(stderr, "%llu bytes scanned", prof.bytes);
+	if(!prof.nctr)
+		fprintf(stderr, ", no hardware counters (%s), times only", strerror(prof.err));
+	fprintf(stderr, "\n%-8s %12s %10s %8s", "phase", "calls", "ms", "ns/B");
+	if(prof.nctr)
+		fprintf(stderr, " %9s %6s %11s %12s", "cycles/B", "IPC", "br-miss/Ki", "LLC-miss/Ki");
+	fprintf(stderr, "\n");
+	for(ph = 0; ph < PH_CAL; ph++)
+		prof_row(names[ph], prof.calls[ph], (ph == PH_SCAN)? scan: prof.sum[ph]);
+}
+
+/*
+ * --follow, like tail -F: scan lines as they're added to the
+ * end of files, noticing when a file is truncated or replaced,
+ * as when logs are rotated.
+ * Only new data is read, with partial lines saved until the rest
+ * shows up. On Linux inotify says when to look, otherwise and
+ * as a backstop we look every FOLLOW_POLL msec.
+ */
+struct follow {
+	const char *fn;
+	int fd;			/* -1 if not open */
+	dev_t dev;		/* which file fd is */
+	ino_t ino;
+	off_t pos;		/* next byte to read */
+	char *buf;		/* partial line and new data */
+	size_t len;
+	size_t size;
+	int done;		/* -m satisfied, stop */
+	int wd;			/* inotify watch on the file, or -1 */
+	struct scanfile sf;
+};
+
+/* read and scan whatever is new in a file */
+static void follow_read(struct follow *fl)
+{
+	struct stat statbuf;
+
+	if(fstat(fl->fd, &statbuf) != 0)
+		return;
+	if(statbuf.st_size < fl->pos) {	/* truncated, start over */
+		fl->pos = 0;
+		fl->len = 0;
+		fl->sf.lineno = fl->sf.lnoff = 0;
+	}
+	while(!fl->done && fl->pos < statbuf.st_size) {
+		size_t want = statbuf.st_size - fl->pos;
+		ssize_t n;
+		char *ep;
+
+		if(want > FOLLOW_CHUNK)
+			want = FOLLOW_CHUNK;
+		if(fl->len+want > fl->size) {
+			fl->size = fl->len+want;
+			fl->buf = realloc(fl->buf, fl->size);
+			if(!fl->buf) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
+		}
+		n = pread(fl->fd, fl->buf+fl->len, want, fl->pos);
+		if(n <= 0)
+			break;
+		fl->pos += n;
+		fl->len += n;
+
+		/* scan the whole lines, keep the rest */
+		for(ep = fl->buf+fl->len; ep > fl->buf && ep[-1] != '\n'; ep--)
+			;
+		if(ep > fl->buf) {
+			fl->sf.boff = fl->pos - fl->len;
+			fl->sf.bp = fl->buf;
+			if(scan_block(fl->buf, ep-fl->buf, &fl->sf)) {
+				file_done(&fl->sf);
+				fl->done = 1;
+			}
+			fl->len -= ep-fl->buf;
+			memmove(fl->buf, ep, fl->len);
+		}
+	}
+	if(profiling)
+		prof_flush(&fl->sf);
+}
+
+/* (re)open a followed file if it's new, then read anything new */
+static void follow_check(struct follow *fl, int ifd)
+{
+	struct stat statbuf;
+
+	if(fl->done)
+		return;
+	if(stat(fl->fn, &statbuf) == 0
+	   && (fl->fd < 0 || statbuf.st_dev != fl->dev || statbuf.st_ino != fl->ino)) {
+		int fd = open(fl->fn, O_RDONLY);
+
+		if(fd >= 0) {
+			if(fl->fd >= 0) {	/* finish the old one */
+				follow_read(fl);
+				if(fl->len && !fl->done) {	/* with a last line that never got a newline */
+					if(fl->len == fl->size) {
+						fl->buf = realloc(fl->buf, ++fl->size);
+						if(!fl->buf) {
+							perror("Out of memory");
+							exit(EXIT_ERROR);
+						}
+					}
+					fl->sf.boff = fl->pos - fl->len;
+					fl->sf.bp = fl->buf;
+					fl->buf[fl->len++] = '\n';
+					if(scan_block(fl->buf, fl->len, &fl->sf)) {
+						file_done(&fl->sf);
+						fl->done = 1;
+					}
+				}
+				close(fl->fd);
+			}
+			fl->fd = fd;
+			fl->dev = statbuf.st_dev;
+			fl->ino = statbuf.st_ino;
+			fl->pos = 0;
+			fl->len = 0;
+			fl->sf.lineno = fl->sf.lnoff = 0;
+#ifdef __linux__
+			if(ifd >= 0) {	/* the old inode's watch isn't wanted */
+				if(fl->wd >= 0)
+					inotify_rm_watch(ifd, fl->wd);
+				fl->wd = inotify_add_watch(ifd, fl->fn, IN_MODIFY);
+			}
+#endif
+		}
+	}
+	if(fl->fd >= 0)
+		follow_read(fl);
+	fflush(stdout);
+}
+
+/* follow files[] forever, or until -m is satisfied for all of them */
+static int follow_files(void)
+{
+	struct follow *fls = calloc(nfiles, sizeof(struct follow));
+	struct pollfd pfd;
+	int i, ndone;
+
+	if(!fls) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	pfd.fd = -1;
+	pfd.events = POLLIN;
+#ifdef __linux__
+	pfd.fd = inotify_init();
+#endif
+	for(i = 0; i < nfiles; i++) {
+		struct follow *fl = &fls[i];
+		struct stat statbuf;
+
+		fl->fn = fl->sf.fn = files[i];
+		fl->sf.jobx = -1;
+		fl->wd = -1;
+		fl->fd = open(fl->fn, O_RDONLY);
+		if(fl->fd < 0)
+			perror(fl->fn);		/* keep looking for it */
+		else if(fstat(fl->fd, &statbuf) == 0) {
+			fl->dev = statbuf.st_dev;
+			fl->ino = statbuf.st_ino;
+			fl->pos = statbuf.st_size;	/* only new lines */
+			if(jsonout || numlines) {
+				fl->sf.lineno = lines_before(fl->fd, fl->pos);
+				fl->sf.lnoff = fl->pos;
+			}
+		}
+#ifdef __linux__
+		if(pfd.fd >= 0) {
+			char *dn = strdup(fl->fn);
+			char *sl = strrchr(dn, '/');
+
+			/* the file, and its directory to see it replaced */
+			if(fl->fd >= 0)
+				fl->wd = inotify_add_watch(pfd.fd, fl->fn, IN_MODIFY);
+			if(sl)
+				sl[sl == dn] = 0;	/* keep / for the root */
+			inotify_add_watch(pfd.fd, sl? dn: ".", IN_CREATE|IN_MOVED_TO);
+			free(dn);
+		}
+#endif
+	}
+
+	for(;;) {
+		if(poll(&pfd, 1, FOLLOW_POLL) > 0) {
+			char evbuf[4096];
+
+			/* what happened doesn't matter, check everything */
+			if(read(pfd.fd, evbuf, sizeof(evbuf)) < 0 && errno != EINTR) {
+				perror("inotify");
+				return EXIT_ERROR;
+			}
+		}
+		for(ndone = i = 0; i < nfiles; i++) {
+			follow_check(&fls[i], pfd.fd);
+			ndone += fls[i].done;
+		}
+		if(ndone == nfiles)
+			return EXIT_OK;
+	}
+}
+
+static void ix_add4(unsigned int addr, unsigned long long line);
+static void ix_add6(const v6addr *addr, unsigned long long line);
+
+#ifdef __SSE2__
+/*
+ * SSE2 versions of the address parsers, for the usual case where the
+ * whole thing fits in one 16 byte load. They only take well formed
+ * input and return NULL for anything else, so the scanner's own
+ * states still do every odd case and the results can't differ.
+ * Never reads past plim.
+ */
+
+/* 0xff in each byte of x that is 0-9, and the value of each byte less '0' */
+static ALWAYS_INLINE __m128i
+simd_digits(__m128i x, __m128i *v)
+{
+	*v = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+	return _mm_cmpeq_epi8(_mm_min_epu8(*v, _mm_set1_epi8(9)), *v);
+}
+
+/* weights for madd of up to four digits, decimal and hex, by number of digits */
+static const short qwdec[5][8] __attribute__((aligned(16))) = {
+	{ 0 }, { 1 }, { 10, 1 }, { 100, 10, 1 }, { 1000, 100, 10, 1 }
+};
+static const short qwhex[5][8] __attribute__((aligned(16))) = {
+	{ 0 }, { 1 }, { 16, 1 }, { 256, 16, 1 }, { 4096, 256, 16, 1 }
+};
+
+#ifdef __SSSE3__
+/* shuffles to put each octet's digits at the end of a 32 bit lane, by octet lengths less one */
+static unsigned char qshuf[3][3][3][3][16] __attribute__((aligned(16)));
+
+static void
+qshuf_init(void)
+{
+	int l[4], i, j, o;
+
+	for(l[0] = 1; l[0] <= 3; l[0]++)
+	for(l[1] = 1; l[1] <= 3; l[1]++)
+	for(l[2] = 1; l[2] <= 3; l[2]++)
+	for(l[3] = 1; l[3] <= 3; l[3]++) {
+		unsigned char *q = qshuf[l[0]-1][l[1]-1][l[2]-1][l[3]-1];
+
+		memset(q, 0x80, 16);	/* zero */
+		for(o = i = 0; i < 4; i++) {
+			for(j = 0; j < l[i]; j++)
+				q[4*i + 4-l[i] + j] = o + j;
+			o += l[i] + 1;
+		}
+	}
+}
+#endif
+
+/* value of the first four 16 bit digits in d with weights w */
+static ALWAYS_INLINE unsigned int
+simd_num(__m128i d, const short *w)
+{
+	__m128i m = _mm_madd_epi16(d, _mm_load_si128((const __m128i *)w));
+
+	return _mm_cvtsi128_si32(m) + _mm_cvtsi128_si32(_mm_srli_si128(m, 4));
+}
+
+static const int p10[5] = { 1, 10, 100, 1000, 10000 };
+
+/*
+ * run of one to four hex digits at s, then something that isn't one.
+ * returns the end of the run, with its value in *val, and its value
+ * as decimal in *dec, or -1 if it's not all 0-9
+ */
+static ALWAYS_INLINE char *
+hex_simd(char *s, const char *plim, unsigned int *val, int *dec)
+{
+	__m128i x, v, dig, lc, let, d;
+	unsigned int md, n;
+
+	if(plim - s < 16)
+		return NULL;
+	x = _mm_loadu_si128((const __m128i *)s);
+	dig = simd_digits(x, &v);
+	lc = _mm_sub_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));	/* a-f A-F to 0-5 */
+	let = _mm_cmpeq_epi8(_mm_min_epu8(lc, _mm_set1_epi8(5)), lc);
+	md = _mm_movemask_epi8(dig);
+	n = __builtin_ctz(~(md | _mm_movemask_epi8(let)));
+	if(n - 1 > 3)
+		return NULL;
+	/* nibble values as 16 bit digits */
+	d = _mm_or_si128(_mm_and_si128(dig, v), _mm_and_si128(let, _mm_add_epi8(lc, _mm_set1_epi8(10))));
+	d = _mm_unpacklo_epi8(d, _mm_setzero_si128());
+	*val = simd_num(d, qwhex[n]);
+	*dec = ((md & ((1u<<n)-1)) == (1u<<n)-1)? (int)simd_num(d, qwdec[n]): -1;
+	return s + n;
+}
+
+/*
+ * dotted quad at s, four octets of one to three digits and then
+ * something that isn't a digit.
+ * returns the end of the fourth octet, with the first three in *hi
+ * and the fourth in *last, which the caller still has to check
+ */
+static ALWAYS_INLINE char *
+quad_simd(char *s, const char *plim, unsigned int *hi, int *last)
+{
+	__m128i x, v;
+	unsigned int nd, dots, len[4], o, i;
+	unsigned int val[4];
+#ifndef __SSSE3__
+	unsigned int at[4];
+#endif
+
+	if(plim - s < 16)
+		return NULL;
+	x = _mm_loadu_si128((const __m128i *)s);
+	nd = ~_mm_movemask_epi8(simd_digits(x, &v));		/* bit 16 and up are set */
+	dots = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8('.')));
+	/* where the octets are */
+	for(o = i = 0; i < 4; i++) {
+#ifndef __SSSE3__
+		at[i] = o;
+#endif
+		len[i] = __builtin_ctz(nd >> o);
+		if(len[i] - 1 > 2)		/* zero or more than three digits */
+			return NULL;
+		o += len[i];
+		if(i < 3) {
+			if(!(dots >> o & 1))
+				return NULL;
+			o++;
+		}
+	}
+	if(o >= 16)				/* might run on into the next load */
+		return NULL;
+#ifdef __SSSE3__
+	/* shuffle the digits into four 32 bit lanes and add them up */
+	x = _mm_shuffle_epi8(v, _mm_load_si128((const __m128i *)qshuf[len[0]-1][len[1]-1][len[2]-1][len[3]-1]));
+	x = _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_set1_epi32(0x010a6400)), _mm_set1_epi16(1));
+	_mm_storeu_si128((__m128i *)val, x);
+#else
+	{
+		unsigned char b[16];
+
+		_mm_storeu_si128((__m128i *)b, v);
+		for(i = 0; i < 4; i++) {
+			const unsigned char *dp = b + at[i];
+
+			val[i] = dp[0];
+			if(len[i] > 1)
+				val[i] = val[i]*10 + dp[1];
+			if(len[i] > 2)
+				val[i] = val[i]*10 + dp[2];
+		}
+	}
+#endif
+	for(i = 0; i < 3; i++)
+		if(val[i] > 255)
+			return NULL;
+	*hi = val[0] << 16 | val[1] << 8 | val[2];
+	*last = val[3];
+	return s + o;
+}
+#endif /* __SSE2__ */
+
+/* scan some text, must be whole lines
+ * generally either one line or the whole file
+ * bp: pointer to buffer
+ * blen: length of buffer
+ * sf: file being scanned, for printing and counting
+ * flags: SF_xxx options, constant in each variant so the
+ * tests for them drop out of the loop
+ * returns 1 if it stopped early, since the file has enough matches
+ * This should handle the full V6 syntax in RFC 4291 sec 2.2 and 2.3 except for
  * :: for a zero address
  * strings of colons may confuse it
  */
-static void scan_block(char *bp, size_t blen, const char *fn)
+/* character tests on sclass[], c must be unsigned */
+#define ISDIGIT(c)	(sclass[c] & C_DIGIT)
+#define ISXDIGIT(c)	(sclass[c] & C_XDIGIT)
+/* what --count-addresses, --rewrite, and --json do with an address */
+#define EACH4(a, from)	do { if(flags&SF_TALLY) tally4(sf, a); \
+		else if(flags&SF_REWRITE) cp = rewrite4(sf, cp, from, p-1, a); \
+		else json4(sf, lp, from, p-1, a); } while(0)
+#define EACH6(a)	do { if(flags&SF_TALLY) tally6(sf, a); \
+		else if(flags&SF_REWRITE) cp = rewrite6(sf, cp, ap, p-1, a); \
+		else json6(sf, lp, ap, p-1, a); } while(0)
+/* pattern lookups, some timed with --profile */
+#define LOOKUP4(r)	(profiling? prof_lookup4(sf, r): netmatch(r))
+#define LOOKUP6(r)	(profiling? prof_lookup6(sf, r): netmatch6(r))
+/* add the rest of a decimal number to v */
+#define DIGITS(v)	while(p < plim && ISDIGIT((unsigned char)*p)) \
+				v = v*10 + *p++ - '0'
+#ifdef __SSE2__
+/* the rest of a hex chunk starting at p-1 in one go, if hex_simd() takes it */
+#define HEXRUN()	{ unsigned int hv; int hd; \
+			if((sp = hex_simd(p-1, plim, &hv, &hd)) != NULL) { \
+				chunk = (chunk << 4*(sp-p+1)) + hv; \
+				octet = (hd < 0)? -1: octet*p10[sp-p+1] + hd; \
+				p = sp; continue; } }
+#else
+#define HEXRUN()
+#endif
+/* move p past the next newline, or to the end, and set ch to match */
+#define SKIPLINE()	do { char *nl = memchr(p, '\n', plim-p); \
+				if(nl) { p = nl+1; ch = '\n'; } else p = plim; } while(0)
+
+static ALWAYS_INLINE int
+scan_body(char *bp, size_t blen, struct scanfile *sf, const unsigned int flags)
 {
 	enum sscan {
 		S_BEG = 0,	/* beginning of line */
@@ -956,7 +6105,8 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 		S_SCNL,		/* scan for new line */
 		S_SCNLP		/* scan for new line and print line */
 	} state;
-	enum sscan snext = anchor?S_SCNL:S_SC;	/* state after not an IP */
+	enum sscan snext = (flags&SF_ANCHOR)?S_SCNL:S_SC;	/* state after not an IP */
+	const unsigned char startmask = C_START | ((flags&SF_QUICK)? C_DOT: 0);
 
 	char *p = bp;		/* current character */
 	char *plim = bp+blen;	/* end of buffer */
@@ -972,10 +6122,16 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 	int nlo = 0;		/* how many bytes in alo */
 	unsigned int chunk = 0;	/* current 16 bit chunk */
 	int seenone = 0;	/* seen an address on this line, for -v */
+	char *ap = bp;		/* start of the current address, for --rewrite */
+	char *cp = bp;		/* first byte --rewrite hasn't printed */
+#ifdef __SSE2__
+	char *sp;		/* end of what the SSE parsers took */
+#endif
 
 	state = S_BEG;
-	for(p = bp; p < plim;) {
-		int ch = *p++;
+	/* --rewrite finishes an address at the very end with a made up newline */
+	for(p = bp; p < plim || ((flags&SF_REWRITE) && p == plim && p > bp && p[-1] != '\n');) {
+		int ch = (p < plim)? (unsigned char)*p++: (p++, '\n');
 
 		switch(state) {
 			case S_BEG:	/* beginning of line */
@@ -983,34 +6139,54 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				seenone = 0;
 				/* skip leading spaces */
 				while(p < plim && (ch == ' ' || ch == '\t'))
-					ch = *p++;
+					ch = (unsigned char)*p++;
 				/* fall through */
 
 			case S_SC:		/* normal scanning */
-				if(isdigit(ch)) {	/* start a potential IP of either type */
+				if(ISDIGIT(ch)) {	/* start a potential IP of either type */
+					ap = p-1;
+#ifdef __SSE2__
+					if((sp = quad_simd(p-1, plim, &ip4, &octet)) != NULL) {
+						p = sp;		/* whole v4 address, finish it */
+						state = S_IP4;
+						continue;
+					}
+#endif
 					ip4 = 0;
 					state = S_IP1;
 					nhi = nlo = 0;
 					octet = chunk = ch-'0';
 					continue;
-				} else if(isxdigit(ch)) {
+				} else if(ISXDIGIT(ch)) {
+					ap = p-1;
 					state = S_HCH;
 					nhi = nlo = 0;
 					octet = -1;	/* hex, not v4 */
-					chunk = xtod(ch);
+					chunk = xval[ch];
 					continue;
 				} else if(ch == ':') {
+					ap = p-1;
 					state = S_IC1;
 					continue;
-				} else if(quick && ch == '.') {
+				} else if((flags&SF_QUICK) && ch == '.') {
 					state = S_NSC;
 					continue;
 				}
+				/* not an IP, skip ahead to anything that might start one */
+				if(!(flags&SF_ANCHOR) && ch != '\n') {
+					while(p < plim && !(sclass[(unsigned char)*p] & startmask))
+						p++;
+					state = S_SC;
+					continue;
+				}
 				break;
 
 			case S_NSC:		/* ignore crud after a dot */
-				if(isdigit(ch) || ch == '.')
+				if(ISDIGIT(ch) || ch == '.') {
+					while(p < plim && (ISDIGIT((unsigned char)*p) || *p == '.'))
+						p++;
 					continue;
+				}
 				state = S_SC;
 				break;
 
@@ -1028,12 +6204,18 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				continue;
 
 			case S_HCH:	/* high v6 chunk */
-				if(isxdigit(ch)) {
-					chunk = (chunk<<4) + xtod(ch);
-					if(isdigit(ch))
-						octet = octet*10 + ch-'0';	/* in case it turns out to be v4 */
-					else
-						octet = -1;			/* hex, can't be v4 */
+				if(ISXDIGIT(ch)) {
+					HEXRUN();
+					for(;;) {	/* the whole chunk */
+						chunk = (chunk<<4) + xval[ch];
+						if(ISDIGIT(ch))
+							octet = octet*10 + ch-'0';	/* in case it turns out to be v4 */
+						else
+							octet = -1;			/* hex, can't be v4 */
+						if(p == plim || !ISXDIGIT((unsigned char)*p))
+							break;
+						ch = (unsigned char)*p++;
+					}
 					continue;
 				}
 				/* finish the current chunk */
@@ -1066,15 +6248,24 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				}
 				/* was it full address? */
 				if(nhi == 16) {
-					if(!n6patterns) break;	/* no v6 patterns */
-					if(cidrsearch && ch == '/') {
+					if(!(flags&SF_V6)) break;	/* no v6 patterns */
+					if((flags&SF_CIDR) && ch == '/') {
 						size = 0;
 						state = S_V6SZ;
 						continue;
 					}
 					seenone = 1;
+					if(flags&SF_INDEX) {
+						ix_add6(&ahi, sf->boff + (lp-bp));
+						break;
+					}
 					range6.min = range6.max = ahi;
-					if(!netmatch6(range6))
+					if(flags&SF_EACH) {	/* each address, not the line */
+						if(!LOOKUP6(range6) != !(flags&SF_INVERT))
+							EACH6(&ahi);
+						break;
+					}
+					if(!LOOKUP6(range6))
 						break; /* didn't match */
 					state = S_SCNLP;
 					goto scnlp;	/* in case it was a \n */
@@ -1082,9 +6273,9 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				break;	/* partial address, not an IP */
 
 			case S_HC1:	/* colon separator in hi part */
-				if(isxdigit(ch)) {
-					chunk = xtod(ch);
-					if(isdigit(ch))
+				if(ISXDIGIT(ch)) {
+					chunk = xval[ch];
+					if(ISDIGIT(ch))
 						octet = ch-'0';
 					else
 						octet = -1;
@@ -1098,9 +6289,9 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				break;	/* not an IP */
 
 			case S_HC2:	/* seen high:: might be end or might be low chunk */
-				if(isxdigit(ch)) {	/* two colons and digit, start low chunks */
-					chunk = xtod(ch);
-					if(isdigit(ch))
+				if(ISXDIGIT(ch)) {	/* two colons and digit, start low chunks */
+					chunk = xval[ch];
+					if(ISDIGIT(ch))
 						octet = chunk;
 					else
 						octet = -1;
@@ -1114,9 +6305,9 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 						continue;
 					break;	/* don't match :: as zero address */
 				}
-				if(!n6patterns) break;	/* no v6 patterns */
+				if(!(flags&SF_V6)) break;	/* no v6 patterns */
 				memset(ahi.a+nhi, 0, 16-nhi);	/* zero low bytes */
-				if(cidrsearch && ch == '/') {
+				if((flags&SF_CIDR) && ch == '/') {
 					size = 0;
 					state = S_V6SZ;
 					continue;
@@ -1124,37 +6315,52 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 					size = -1;
 
 				seenone = 1;
+				if(flags&SF_INDEX) {
+					ix_add6(&ahi, sf->boff + (lp-bp));
+					break;
+				}
 				range6.min = range6.max = ahi;
-				if(!netmatch6(range6))
+				if(flags&SF_EACH) {	/* each address, not the line */
+					if(!LOOKUP6(range6) != !(flags&SF_INVERT))
+						EACH6(&ahi);
+					break;
+				}
+				if(!LOOKUP6(range6))
 					break; /* didn't match */
 				state = S_SCNLP;
 				goto scnlp;	/* in case it was a \n */
 
 			case S_V6SZ:
-				if(isdigit(ch)) {
+				if(ISDIGIT(ch)) {
 					if (size >= 0)
 						size = size*10 + ch-'0';
 					if(size > 128) /* gobble up the rest */
 						size = -1;
 					continue;
 				}
-				if(!n6patterns) break;	/* no v6 patterns */
+				if(!(flags&SF_V6)) break;	/* no v6 patterns */
 				seenone = 1;
 				if (size < 0) size = 0; /* ignore bad prefix */
 				/* TODO: check badbits? naah */
 				applymask6(ahi, size, &range6);
-				if(!netmatch6(range6))
+				if(!LOOKUP6(range6))
 					break; /* didn't match */
 				state = S_SCNLP;
 				goto scnlp;	/* in case it was a \n */
 
 			case S_LCH:		/* low chunk */
-				if(isxdigit(ch)) {
-					chunk = (chunk<<4)+xtod(ch);
-					if(isdigit(ch))
-						octet = octet*10 + ch-'0';	/* in case it turns out to be v4 */
-					else
-						octet = -1;
+				if(ISXDIGIT(ch)) {
+					HEXRUN();
+					for(;;) {	/* the whole chunk */
+						chunk = (chunk<<4) + xval[ch];
+						if(ISDIGIT(ch))
+							octet = octet*10 + ch-'0';	/* in case it turns out to be v4 */
+						else
+							octet = -1;
+						if(p == plim || !ISXDIGIT((unsigned char)*p))
+							break;
+						ch = (unsigned char)*p++;
+					}
 					continue;
 				}
 				/* finish the current chunk */
@@ -1184,26 +6390,35 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 					continue;
 				}
 				/* end of lo part, check it */
-				if(!n6patterns) break;		/* no v6 patterns */
+				if(!(flags&SF_V6)) break;		/* no v6 patterns */
 				if((nhi+nlo) >= 14) break;	/* too many chunks. not an IP */
 				memset(ahi.a+nhi, 0, 16-(nhi+nlo));	/* combine hi and lo parts */
 				memcpy(ahi.a+(16-nlo), alo.a, nlo);
-				if(cidrsearch && ch == '/') {
+				if((flags&SF_CIDR) && ch == '/') {
 					state = S_V6SZ;
 					size = 0;
 					continue;
 				}
 				seenone = 1;
+				if(flags&SF_INDEX) {
+					ix_add6(&ahi, sf->boff + (lp-bp));
+					break;
+				}
 				range6.min = range6.max = ahi;
-				if(!netmatch6(range6))
+				if(flags&SF_EACH) {	/* each address, not the line */
+					if(!LOOKUP6(range6) != !(flags&SF_INVERT))
+						EACH6(&ahi);
+					break;
+				}
+				if(!LOOKUP6(range6))
 					break; /* didn't match */
 				state = S_SCNLP;
 				goto scnlp;	/* in case it was a \n */
 
 			case S_LC1:	/* seen a colon after a low chunk */
-				if(isxdigit(ch)) {
-					chunk = xtod(ch);
-					if(isdigit(ch))
+				if(ISXDIGIT(ch)) {
+					chunk = xval[ch];
+					if(ISDIGIT(ch))
 						octet = chunk;
 					else
 						octet = -1;
@@ -1213,9 +6428,9 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				break;	/* trailing junk, not an IP */
 
 			case S_IP1:	/* in an IP address, don't know yet which kind */
-				if(isxdigit(ch)) {
-					chunk = (chunk<<4) + xtod(ch);
-					if(!isdigit(ch)) {
+				if(ISXDIGIT(ch)) {
+					chunk = (chunk<<4) + xval[ch];
+					if(!ISDIGIT(ch)) {
 						state = S_HCH;	/* doesn't look like a v4 address */
 						octet = -1;
 						continue;
@@ -1231,8 +6446,10 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				/* fall through */
 			case S_IP2:
 			case S_IP3:
-				if(isdigit(ch)) {
+				if(ISDIGIT(ch)) {
 					octet = octet*10 + ch-'0';
+					if(state != S_IP1)	/* S_IP1 has to track the chunk too */
+						DIGITS(octet);
 					continue;
 				}
 				if(ch == '.') {
@@ -1253,7 +6470,7 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 			case S_EIP1D:	/* saw dot after an embedded octet */
 			case S_EIP2D:
 			case S_EIP3D:
-				if(isdigit(ch)) {
+				if(ISDIGIT(ch)) {
 					octet = ch-'0';
 					state++;	/* next digit state */
 					continue;
@@ -1261,12 +6478,13 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				break;	/* wasn't an IP */
 
 			case S_IP4:	/* in last octet */
-				if(isdigit(ch)) {
+				if(ISDIGIT(ch)) {
 					octet = octet*10 + ch-'0';
+					DIGITS(octet);
 					continue;
 				}
 				/* OK, we have the IP */
-				if(quick && ch == '.') {	/* seen crud, skip it */
+				if((flags&SF_QUICK) && ch == '.') {	/* seen crud, skip it */
 					state = S_NSC;
 					continue;
 				}
@@ -1275,21 +6493,30 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				}
 				ip4 <<= 8;
 				ip4 += octet;
-				if(!npatterns) break; /* no v4 patterns */
-				if(cidrsearch && ch == '/') {
+				if(!(flags&SF_V4)) break; /* no v4 patterns */
+				if((flags&SF_CIDR) && ch == '/') {
 					state = S_V4SZ;
 					size = 0;
 					continue;
 				}
 				seenone = 1;
+				if(flags&SF_INDEX) {
+					ix_add4(ip4, sf->boff + (lp-bp));
+					break;
+				}
 				range4.min = range4.max = ip4;
-				if(!netmatch(range4))
+				if(flags&SF_EACH) {	/* each address, not the line */
+					if(!LOOKUP4(range4) != !(flags&SF_INVERT))
+						EACH4(ip4, ap);
+					break;
+				}
+				if(!LOOKUP4(range4))
 					break; /* didn't match */
 				state = S_SCNLP;
 				goto scnlp;	/* in case it was a \n */
 
                         case S_V4SZ:    /* cidr size */
-				if(isdigit(ch)) {
+				if(ISDIGIT(ch)) {
 					if (size >= 0)
 						size = size*10 + ch-'0';
 					if(size > 32) /* gobble up the rest */
@@ -1303,15 +6530,16 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 					range4.min &= ~mask; /* force to CIDR boundary */
 					range4.max |= mask;
 				}
-				if(!netmatch(range4))
+				if(!LOOKUP4(range4))
 					break; /* didn't match */
 				state = S_SCNLP;
 				goto scnlp;	/* in case it was a \n */
 				
 			case S_EIP2:	/* in embedded octet */
 			case S_EIP3:
-				if(isdigit(ch)) {
+				if(ISDIGIT(ch)) {
 					octet = octet*10 + ch-'0';
+					DIGITS(octet);
 					continue;
 				}
 				if(ch == '.') {
@@ -1326,12 +6554,13 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				break;
 
 			case S_EIP4:	/* in last embedded octet */
-				if(isdigit(ch)) {
+				if(ISDIGIT(ch)) {
 					octet = octet*10 + ch-'0';
+					DIGITS(octet);
 					continue;
 				}
 				/* OK, we have the IP */
-				if(quick && ch == '.') {	/* seen crud, skip it */
+				if((flags&SF_QUICK) && ch == '.') {	/* seen crud, skip it */
 					state = S_NSC;
 					continue;
 				}
@@ -1341,9 +6570,32 @@ static void scan_block(char *bp, size_t blen, const char *fn)
                                 /* no CIDR allowed with IPv4 embedded in IPv6 */
 				ahi.a[nhi++] = octet;
 				seenone = 1;
-				if(n6patterns) {
+				if(flags&SF_INDEX) {	/* both ways, as below */
+					ix_add6(&ahi, (sf->boff + (lp-bp)) | IX_EMBED);
+					ix_add4((ahi.a[12]<<24)|(ahi.a[13]<<16)|(ahi.a[14]<<8)|ahi.a[15],
+						(sf->boff + (lp-bp)) | IX_EMBED);
+					break;
+				}
+				if(flags&SF_EACH) {	/* whichever way it matched */
+					range6.min = range6.max = ahi;
+					range4.min = range4.max = (ahi.a[12]<<24)|(ahi.a[13]<<16)|(ahi.a[14]<<8)|ahi.a[15];
+					if((flags&SF_V6) && LOOKUP6(range6)) {
+						if(!(flags&SF_INVERT))
+							EACH6(&ahi);
+					} else if((flags&SF_V4) && LOOKUP4(range4)) {
+						char *qp = p-1;		/* just the dotted quad */
+
+						while(qp > ap && qp[-1] != ':')
+							qp--;
+						if(!(flags&SF_INVERT))
+							EACH4(range4.min, qp);
+					} else if(flags&SF_INVERT)
+						EACH6(&ahi);
+					break;
+				}
+				if(flags&SF_V6) {
 					range6.min = range6.max = ahi;
-					if(netmatch6(range6)) {	/* try a v6 pattern */
+					if(LOOKUP6(range6)) {	/* try a v6 pattern */
 						state = S_SCNLP;
 						goto scnlp;	/* in case it was a \n */
 					}
@@ -1351,13 +6603,13 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 				/* get the v4 address as an int and try
 				 * that */
 				ip4 = (ahi.a[12]<<24)|(ahi.a[13]<<16)|(ahi.a[14]<<8)|ahi.a[15];
-				if(cidrsearch && ch == '/') {
+				if((flags&SF_CIDR) && ch == '/') {
 					state = S_V4SZ;
 					size = 0;
 					continue;
 				}
 				range4.min = range4.max = ip4;
-				if(!npatterns || !netmatch(range4))
+				if(!(flags&SF_V4) || !LOOKUP4(range4))
 					break; /* didn't match */
 
 				state = S_SCNLP;
@@ -1365,38 +6617,34 @@ static void scan_block(char *bp, size_t blen, const char *fn)
 
 scnlp:
 			case S_SCNLP:	/* print this line */
-				/* HACK scan the rest of the line fast */
-				while(ch != '\n' && p < plim)
-					ch = *p++;
+				if(ch != '\n')		/* skip the rest of the line */
+					SKIPLINE();
 
 				if(ch == '\n') {
-					if(!invert) {
-						nmatch++;
-						if(!counting) {
-							if(fn && !nonames)
-								printf("%s:", fn);
-							fwrite(lp, 1, p-lp, stdout);
-						}
+					if(!(flags&SF_INVERT)) {
+						sf->nmatch++;
+						if(!(flags&SF_COUNT))
+							print_line(sf, lp, p-lp);
+						if(sf->nmatch >= stopafter)
+							return 1;
 					}
 					state = S_BEG;
 				}
 				continue;
 
 			case S_SCNL:
-				/* HACK scan the rest of the line fast */
-				while(ch != '\n' && p < plim)
-					ch = *p++;
+				if(ch != '\n')		/* skip the rest of the line */
+					SKIPLINE();
 				break;
 		}
 		/* default action if it wasn't an IP */
 		if(ch == '\n') {
-			if(invert && seenone) {	/* -v prints or counts lines with IPs that didn't match */
-				nmatch++;
-				if(!counting) {
-					if(fn && !nonames)
-						printf("%s:", fn);
-					fwrite(lp, 1, p-lp, stdout);
-				}
+			if((flags&(SF_INVERT|SF_EACH)) == SF_INVERT && seenone) {	/* -v prints or counts lines with IPs that didn't match */
+				sf->nmatch++;
+				if(!(flags&SF_COUNT))
+					print_line(sf, lp, p-lp);
+				if(sf->nmatch >= stopafter)
+					return 1;
 			}
 			state = S_BEG;
 		} else
@@ -1404,7 +6652,212 @@ scnlp:
 		continue;
 
 	}
-} /* scan_block */
+	if(flags&SF_REWRITE)	/* the rest as it was */
+		print_span(sf, cp, plim-cp);
+	if((flags&SF_JSON) || numlines)
+		count_lines(sf, plim);
+	return 0;
+} /* scan_body */
+
+#undef EACH4
+#undef LOOKUP4
+#undef LOOKUP6
+#undef HEXRUN
+#undef EACH6
+#undef DIGITS
+#undef SKIPLINE
+
+/*
+ * Specialized scanners for the common combinations of patterns
+ * and flags, chosen once in pick_scanner(). -q and -C are rare,
+ * so they use scan_any() which tests everything as it goes,
+ * as do --count-addresses, --rewrite, and --json.
+ */
+#define SCANNER(f) \
+static int scan_##f(char *bp, size_t blen, struct scanfile *sf) \
+{ return scan_body(bp, blen, sf, f); }
+
+SCANNER(1)  SCANNER(2)  SCANNER(3)  SCANNER(5)  SCANNER(6)  SCANNER(7)
+SCANNER(9)  SCANNER(10) SCANNER(11) SCANNER(13) SCANNER(14) SCANNER(15)
+SCANNER(17) SCANNER(18) SCANNER(19) SCANNER(21) SCANNER(22) SCANNER(23)
+SCANNER(25) SCANNER(26) SCANNER(27) SCANNER(29) SCANNER(30) SCANNER(31)
+
+static unsigned int scanflags;		/* flags for scan_any() */
+
+static int scan_any(char *bp, size_t blen, struct scanfile *sf)
+{
+	return scan_body(bp, blen, sf, scanflags);
+}
+
+/* --index, every address whether or not there are patterns */
+static int scan_index(char *bp, size_t blen, struct scanfile *sf)
+{
+	return scan_body(bp, blen, sf, SF_V4|SF_V6|SF_INDEX);
+}
+
+static int (*const scanners[32])(char *bp, size_t blen, struct scanfile *sf) = {
+	scan_any, scan_1,  scan_2,  scan_3,  scan_any, scan_5,  scan_6,  scan_7,
+	scan_any, scan_9,  scan_10, scan_11, scan_any, scan_13, scan_14, scan_15,
+	scan_any, scan_17, scan_18, scan_19, scan_any, scan_21, scan_22, scan_23,
+	scan_any, scan_25, scan_26, scan_27, scan_any, scan_29, scan_30, scan_31
+};
+
+/* set scan_block to the best scanner for the patterns and flags */
+static void pick_scanner(void)
+{
+	int c;
+
+	for(c = 0; c < 256; c++) {
+		if(isxdigit(c) || c == ':' || c == '\n')
+			sclass[c] |= C_START;
+		if(c == '.')
+			sclass[c] |= C_DOT;
+		if(isdigit(c))
+			sclass[c] |= C_DIGIT;
+		if(isxdigit(c)) {
+			sclass[c] |= C_XDIGIT;
+			xval[c] = xtod(c);
+		}
+	}
+#ifdef __SSSE3__
+	qshuf_init();
+#endif
+	scanflags = (npatterns? SF_V4: 0) | (n6patterns? SF_V6: 0)
+		| (anchor? SF_ANCHOR: 0) | (invert? SF_INVERT: 0)
+		| ((counting || listfiles || silent || tallying || rewriting || jsonout)? SF_COUNT: 0) | (quick? SF_QUICK: 0)
+		| (cidrsearch? SF_CIDR: 0) | (tallying? SF_TALLY: 0) | (rewriting? SF_REWRITE: 0)
+		| (jsonout? SF_JSON: 0);
+	if(indexing || external)
+		scan_block = scan_index;
+	else if(scanflags & (SF_QUICK|SF_CIDR|SF_EACH))
+		scan_block = scan_any;
+	else
+		scan_block = scanners[scanflags];
+	if(profiling) {
+		scan_inner = scan_block;
+		scan_block = scan_prof;
+	}
+}
+
+/*
+ * The cover map has two bits for each /24 saying whether the
+ * patterns cover none of it, all of it, or part of it.
+ * Only the partly covered ones need a search of array[], and with
+ * a big pattern list most addresses will be in /24s that are
+ * all or nothing, so a lookup is one memory reference.
+ * Built from the merged array, so ranges don't overlap.
+ */
+#define COVER_NONE	0
+#define COVER_ALL	1
+#define COVER_PART	2
+#define cover_get(b)	((cover24[(b)>>2] >> (((b)&3)*2)) & 3)
+
+static void build_cover(void)
+{
+	struct netspec *sp;
+
+	cover24 = calloc(1<<22, 1);	/* 2^24 entries, four per byte */
+	if(!cover24)
+		return;		/* no big deal, just search */
+	for(sp = array; sp < array+npatterns; sp++) {
+		unsigned int b;
+
+		for(b = sp->min>>8; b <= sp->max>>8; b++) {
+			int cov = COVER_PART;
+
+			if(sp->min <= b<<8 && sp->max >= (b<<8|255))
+				cov = COVER_ALL;
+			cover24[b>>2] |= cov << ((b&3)*2);
+			if(b == 0xffffff)
+				break;	/* don't wrap */
+		}
+	}
+}
+
+/*
+ * With only a few patterns, e.g. the RFC 1918 networks, a binary
+ * search is mostly branch mispredictions. Instead keep the ranges
+ * in separate min and max arrays and compare against all of them
+ * with no branches, which the compiler turns into vector compares.
+ * Pad to a multiple of 8 by repeating the last range, so there's
+ * no odd tail for the vector loop.
+ */
+static unsigned long long
+get64(const unsigned char *a)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for(i = 0; i < 8; i++)
+		v = (v<<8) | a[i];
+	return v;
+}
+
+static void build_small(void)
+{
+	int i;
+
+	if(npatterns && npatterns <= SMALLSET) {
+		for(i = 0; i < SMALLSET; i++) {
+			int x = (i < npatterns)? i: npatterns-1;
+
+			small4.min[i] = array[x].min;
+			small4.max[i] = array[x].max;
+		}
+		nsmall4 = (npatterns+7) & ~7;
+	}
+	if(n6patterns && n6patterns <= SMALLSET) {
+		for(i = 0; i < SMALLSET; i++) {
+			int x = (i < n6patterns)? i: n6patterns-1;
+
+			small6.minhi[i] = get64(array6[x].min.a);
+			small6.minlo[i] = get64(array6[x].min.a+8);
+			small6.maxhi[i] = get64(array6[x].max.a);
+			small6.maxlo[i] = get64(array6[x].max.a+8);
+		}
+		nsmall6 = (n6patterns+7) & ~7;
+	}
+}
+
+static int
+netmatch_small(const struct netspec ip4)
+{
+	unsigned int hit = 0;
+	int i;
+
+	if(didrsearch) {	/* overlaps any range */
+		for(i = 0; i < nsmall4; i++)
+			hit |= (ip4.min <= small4.max[i]) & (ip4.max >= small4.min[i]);
+	} else {		/* inside a range */
+		for(i = 0; i < nsmall4; i++)
+			hit |= (ip4.min >= small4.min[i]) & (ip4.max <= small4.max[i]);
+	}
+	return hit;
+}
+
+/* a >= b and a <= b on 128 bit values in two halves */
+#define GE128(ahi, alo, bhi, blo) (((ahi) > (bhi)) | (((ahi) == (bhi)) & ((alo) >= (blo))))
+#define LE128(ahi, alo, bhi, blo) (((ahi) < (bhi)) | (((ahi) == (bhi)) & ((alo) <= (blo))))
+
+static int
+netmatch6_small(const struct netspec6 ip6)
+{
+	unsigned long long minhi = get64(ip6.min.a), minlo = get64(ip6.min.a+8);
+	unsigned long long maxhi = get64(ip6.max.a), maxlo = get64(ip6.max.a+8);
+	unsigned int hit = 0;
+	int i;
+
+	if(didrsearch) {
+		for(i = 0; i < nsmall6; i++)
+			hit |= LE128(minhi, minlo, small6.maxhi[i], small6.maxlo[i])
+				& GE128(maxhi, maxlo, small6.minhi[i], small6.minlo[i]);
+	} else {
+		for(i = 0; i < nsmall6; i++)
+			hit |= GE128(minhi, minlo, small6.minhi[i], small6.minlo[i])
+				& LE128(maxhi, maxlo, small6.maxhi[i], small6.maxlo[i]);
+	}
+	return hit;
+}
 
 /*
  * binary range search for a value
@@ -1425,6 +6878,16 @@ netmatch(const struct netspec ip4)
 		       ip4.max, ip4.max>>24, (ip4.max>>16)&255, (ip4.max>>8)&255, ip4.max&255);
 	}
 # endif
+	if(nsmall4)
+		return netmatch_small(ip4);
+	if(cover24 && ip4.min == ip4.max) {	/* single address, try the cover map */
+		switch(cover_get(ip4.min>>8)) {
+		case COVER_NONE:
+			return 0;
+		case COVER_ALL:
+			return 1;
+		}
+	}
 	/* make sure it's in range */
 	if(ip4.max < array[0].min || ip4.min > array[maxx].max) return 0;
 
@@ -1454,6 +6917,347 @@ netmatch(const struct netspec ip4)
 	return 0;	/* not in the current entry */
 }
 
+/*
+ * A big v6 list takes 32 bytes a range in array6[], so it's packed
+ * into pages of PAGE6 ranges, while loading a chunk at a time and
+ * then once it's merged. Most ranges are
+ * CIDR blocks, kept as the prefix length and the bytes of the prefix
+ * that differ from the previous range's first address, which in a
+ * sorted list is a few bytes. Other ranges keep the whole first and
+ * last address, still less what they share. Each entry is
+ *	length, or 255 for a range
+ *	bytes shared with the previous first address
+ *	the rest of the first address, to the end of the prefix
+ *	for a range, bytes the last address shares with the first, and the rest
+ * The first address of each page is kept in full for a binary search,
+ * then the page is decoded in order.
+ */
+
+/* prefix length if r is a CIDR block, else -1 */
+static int
+cidr6len(const struct netspec6 *r)
+{
+	int i = 15, x;
+
+	while(i >= 0 && r->min.a[i] == 0 && r->max.a[i] == 255)
+		i--;
+	if(i < 0)
+		return 0;
+	x = r->min.a[i] ^ r->max.a[i];
+	if((x & (x+1)) || (r->min.a[i] & x) || memcmp(r->min.a, r->max.a, i))
+		return -1;
+	return 8*i + 8 - __builtin_popcount(x);
+}
+
+/* bytes a and b share at the front */
+static int
+shared6(const v6addr *a, const v6addr *b)
+{
+	int k = 0;
+
+	while(k < 16 && a->a[k] == b->a[k])
+		k++;
+	return k;
+}
+
+/* pack r after a range starting at prev, into d unless it's NULL, returns the length */
+static size_t
+pack6_put(unsigned char *d, const struct netspec6 *r, const v6addr *prev)
+{
+	int len = cidr6len(r);
+	int m = (len < 0)? 16: (len+7)/8;	/* bytes that matter */
+	int k = shared6(&r->min, prev);
+	size_t n = 2 + ((k < m)? m-k: 0);
+
+	if(len < 0)
+		n += 1 + 16 - shared6(&r->max, &r->min);
+	if(!d)
+		return n;
+	*d++ = (len < 0)? 255: len;
+	*d++ = k;
+	if(k < m) {
+		memcpy(d, r->min.a+k, m-k);
+		d += m-k;
+	}
+	if(len < 0) {
+		k = shared6(&r->max, &r->min);
+		*d++ = k;
+		memcpy(d, r->max.a+k, 16-k);
+	}
+	return n;
+}
+
+/* decode the first address of the entry at d over the previous one in *a, returns the next entry */
+static ALWAYS_INLINE const unsigned char *
+unpack6_min(const unsigned char *d, v6addr *a)
+{
+	int len = d[0], k = d[1];
+	int m = (len == 255)? 16: (len+7)/8;
+
+	d += 2;
+	if(k < m) {
+		memcpy(a->a+k, d, m-k);
+		d += m-k;
+		k = m;
+	}
+	if(len == 255)
+		d += 1 + 16 - *d;
+	else
+		memset(a->a+k, 0, 16-k);
+	return d;
+}
+
+/* decode the last address of the entry at d, given its first address in r->min */
+static void
+unpack6_max(const unsigned char *d, struct netspec6 *r)
+{
+	int len = d[0], k = d[1];
+
+	if(len == 255) {
+		d += 2 + ((k < 16)? 16-k: 0);
+		k = *d++;
+		memcpy(r->max.a, r->min.a, k);
+		memcpy(r->max.a+k, d, 16-k);
+		return;
+	}
+	r->max = r->min;
+	if(len % 8)
+		r->max.a[len/8] |= 255 >> (len%8);
+	if(len < 128)
+		memset(r->max.a + (len+7)/8, 255, 16 - (len+7)/8);
+}
+
+/* decode the entry at d, given the previous first address in r->min, returns the next */
+static const unsigned char *
+unpack6(const unsigned char *d, struct netspec6 *r)
+{
+	const unsigned char *next = unpack6_min(d, &r->min);
+
+	unpack6_max(d, r);
+	return next;
+}
+
+/* next range in a pass, returns 0 at the end */
+static int
+p6next(struct p6iter *it)
+{
+	const struct pack6 *p = it->p;
+
+	if(!p) {
+		if(it->i >= n6patterns)
+			return 0;
+		it->r = array6[it->i++];
+		return 1;
+	}
+	if(it->i >= p->n)
+		return 0;
+	if(it->i % PAGE6 == 0) {
+		it->r.min = p->pmin[it->i / PAGE6];
+		it->d = p->data + p->poff[it->i / PAGE6];
+	}
+	it->d = unpack6(it->d, &it->r);
+	it->i++;
+	return 1;
+}
+
+/* add r to p, only counting the bytes if p->data is NULL */
+static void
+pack6_add(struct pack6 *p, const struct netspec6 *r, v6addr *prev, size_t *len)
+{
+	unsigned int i = p->n++;
+
+	if(i % PAGE6 == 0) {
+		*prev = r->min;
+		if(p->data) {
+			p->pmin[i/PAGE6] = r->min;
+			p->poff[i/PAGE6] = *len;
+		}
+	}
+	*len += pack6_put(p->data? p->data + *len: NULL, r, prev);
+	*prev = r->min;
+	if(i == 0)
+		p->lo = r->min;
+	p->hi = r->max;
+}
+
+/*
+ * pack the sorted ranges in x and y into p, combining overlaps as
+ * combine6() does. NULL x is array6[], NULL y is nothing.
+ * The first pass counts, so the buffers are just big enough.
+ */
+static void
+pack6_make(struct pack6 *p, const struct pack6 *x, const struct pack6 *y)
+{
+	int pass;
+	size_t total = 0;
+
+	memset(p, 0, sizeof(*p));
+	for(pass = 0; pass < 2; pass++) {
+		struct p6iter ix = { x }, iy = { y };
+		int hx = p6next(&ix), hy = y? p6next(&iy): 0, have = 0;
+		struct netspec6 cur, next;
+		v6addr prev;
+		size_t len = 0;
+
+		if(pass) {
+			p->npages = (p->n + PAGE6-1) / PAGE6;
+			p->pmin = malloc(p->npages * sizeof(v6addr) + 1);
+			p->poff = malloc((p->npages+1) * sizeof(size_t));
+			p->data = malloc(total + 1);
+			if(!p->pmin || !p->poff || !p->data) {
+				perror("Out of memory");
+				exit(EXIT_ERROR);
+			}
+		}
+		p->n = 0;
+		while(hx || hy) {
+			if(hx && (!hy || netsort6(&ix.r, &iy.r) <= 0)) {
+				next = ix.r;
+				hx = p6next(&ix);
+			} else {
+				next = iy.r;
+				hy = p6next(&iy);
+			}
+			if(have && v6cmp(next.max, cur.max) <= 0)
+				continue;		/* contained within previous range */
+			if(have && v6cmp(next.min, cur.max) <= 0) {
+				cur.max = next.max;	/* overlapping, combine */
+				continue;
+			}
+			if(have)
+				pack6_add(p, &cur, &prev, &len);
+			cur = next;
+			have = 1;
+		}
+		if(have)
+			pack6_add(p, &cur, &prev, &len);
+		if(pass)
+			p->poff[p->npages] = len;
+		else
+			total = len;
+	}
+}
+
+static size_t
+pack6_size(const struct pack6 *p)
+{
+	return p->poff[p->npages] + p->npages*(sizeof(v6addr) + sizeof(size_t));
+}
+
+static void
+pack6_free(struct pack6 *p)
+{
+	free(p->pmin);
+	free(p->poff);
+	free(p->data);
+}
+
+/*
+ * pack the sorted and combined array6[] away as a run and empty it,
+ * so a big list never needs all of it in array6[] at once. Runs of
+ * the same number of chunks are merged as they come, like a binary
+ * counter, and merge_patterns() merges the rest.
+ */
+static void
+run6_add(void)
+{
+	struct pack6 *r = realloc(runs6, (nruns6+1) * sizeof(struct pack6));
+
+	if(!r) {
+		perror("Out of memory");
+		exit(EXIT_ERROR);
+	}
+	runs6 = r;
+	pack6_make(&runs6[nruns6], NULL, NULL);
+	runs6[nruns6].chunks = 1;
+	runs6len += pack6_size(&runs6[nruns6++]);
+	n6patterns = 0;
+	while(nruns6 > 1 && runs6[nruns6-2].chunks <= runs6[nruns6-1].chunks)
+		run6_merge();
+}
+
+/* merge the last two runs */
+static void
+run6_merge(void)
+{
+	struct pack6 m, *a = &runs6[nruns6-2], *b = &runs6[nruns6-1];
+
+	pack6_make(&m, a, b);
+	m.chunks = a->chunks + b->chunks;
+	runs6len -= pack6_size(a) + pack6_size(b);
+	runs6len += pack6_size(&m);
+	pack6_free(a);
+	pack6_free(b);
+	*a = m;
+	nruns6--;
+}
+
+/* pack the merged v6 patterns if there are a lot and they aren't already */
+static void
+build_pack6(void)
+{
+	if(packed6.n || n6patterns < PACK6_MIN)
+		return;
+	pack6_make(&packed6, NULL, NULL);
+	free(array6);
+	array6 = NULL;
+	capacity6 = 0;
+}
+
+/*
+ * netmatch6() for packed patterns, find the page and then the last
+ * range starting at or before the address. With -D, if the address
+ * starts before that range ends or in the gap after it, the only
+ * range it can overlap is that one or the next.
+ */
+static int
+netmatch6_packed(const struct netspec6 ip6)
+{
+	unsigned int lo = 0, hi = packed6.npages;
+	const unsigned char *d, *end, *at = NULL, *nx = NULL;
+	struct netspec6 r, e;
+
+	if(v6cmp(ip6.max, packed6.lo) < 0 || v6cmp(ip6.min, packed6.hi) > 0)
+		return 0;
+	while(hi - lo > 1) {	/* last page starting at or before it */
+		unsigned int mid = (lo+hi)/2;
+
+		if(v6cmp(packed6.pmin[mid], ip6.min) <= 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	d = packed6.data + packed6.poff[lo];
+	end = packed6.data + packed6.poff[lo+1];
+	e.min = packed6.pmin[lo];
+	while(d < end) {
+		const unsigned char *x = d;
+
+		d = unpack6_min(d, &e.min);
+		if(v6cmp(e.min, ip6.min) > 0) {
+			nx = x;		/* the one after */
+			break;
+		}
+		at = x;
+		r.min = e.min;
+	}
+	if(at) {
+		unpack6_max(at, &r);
+		if(v6cmp(ip6.min, r.max) <= 0)	/* starts in this range */
+			return v6cmp(ip6.max, r.max) <= 0 || didrsearch;
+	}
+	if(!didrsearch)
+		return 0;
+	if(nx)
+		unpack6_max(nx, &e);
+	else if(lo+1 < packed6.npages) {	/* first in the next page */
+		e.min = packed6.pmin[lo+1];
+		unpack6_max(packed6.data + packed6.poff[lo+1], &e);
+	} else
+		return 0;
+	return v6cmp(ip6.max, e.min) >= 0;	/* runs into the next one */
+}
+
 static int
 netmatch6(const struct netspec6 ip6)
 {
@@ -1473,13 +7277,17 @@ netmatch6(const struct netspec6 ip6)
 		printf("\n");
 	}
 # endif
+	if(nsmall6)
+		return netmatch6_small(ip6);
+	if(packed6.n)
+		return netmatch6_packed(ip6);
 	/* make sure it's in range */
 	if(v6cmp(ip6.max, array6[0].min) < 0 || v6cmp(ip6.min, array6[maxx].max) > 0) return 0;
 
 	while(minx <= maxx) {
 		tryx = (minx+maxx)/2;
 
-		if(v6cmp(ip6.min, array6[tryx].min)<0) {
+		if(v6cmp(ip6.max, array6[tryx].min)<0) {
 			maxx = tryx-1;
 			continue;
 		}
@@ -1511,3 +7319,36 @@ netmatch6(const struct netspec6 ip6)
 	}
 	return 0;	/* not in the current entry */
 }
+
+/*
+ * match a batch of single v4 addresses, setting hit[] for each.
+ * With the cover map, look them all up there first, since the
+ * loads don't depend on each other, then search for the few
+ * in partly covered /24s.
+ */
+static void
+netmatch_batch(const unsigned int *a, int n, unsigned char *hit)
+{
+	struct netspec r;
+	int k;
+
+	if(!npatterns) {
+		memset(hit, 0, n);
+		return;
+	}
+	if(cover24 && !nsmall4) {
+		for(k = 0; k < n; k++)
+			hit[k] = cover_get(a[k]>>8);
+		for(k = 0; k < n; k++) {
+			if(hit[k] == COVER_PART) {
+				r.min = r.max = a[k];
+				hit[k] = netmatch(r);
+			}
+		}
+		return;
+	}
+	for(k = 0; k < n; k++) {
+		r.min = r.max = a[k];
+		hit[k] = netmatch(r);
+	}
+}
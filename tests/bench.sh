@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Scanner throughput on the inputs behind the figures for the byte class
+# table: a mail log of 4.5M lines (1.5M lines three times over) with 1000
+# v4 CIDR patterns, scanned with -c, -v, and -a, and 3M lines of random
+# v4 addresses with -c.  Prints user mode cycles if perf is installed,
+# otherwise CPU seconds.
+#
+#	tests/bench.sh		time ./grepcidr, or GREPCIDR
+#	REF=old tests/bench.sh	and another build for comparison
+#
+# The inputs take about 500MB in $TMPDIR.
+
+dir=`dirname "$0"`
+tmp=${TMPDIR:-/tmp}/grepcidr-bench.$$
+trap 'rm -rf "$tmp"' 0
+trap 'exit 2' 1 2 15
+mkdir "$tmp" || exit 2
+
+"$dir/mkcorpus" mail 1500000 1 > "$tmp/mail1" &&
+cat "$tmp/mail1" "$tmp/mail1" "$tmp/mail1" > "$tmp/mail" &&
+"$dir/mkcorpus" v4 3000000 2 > "$tmp/v4" &&
+"$dir/mkcorpus" cidr 1000 3 > "$tmp/list" || exit 2
+rm -f "$tmp/mail1"
+
+# cost BIN ARGS..., of running BIN twice, the first to warm the cache
+cost() {
+	"$@" > /dev/null 2>&1
+	if command -v perf > /dev/null 2>&1; then
+		perf stat -x, -e cycles:u "$@" 2>&1 > /dev/null |
+			awk -F, '/cycles/ { printf "%dM cycles\n", $1/1e6 }'
+	else
+		( "$@" > /dev/null 2>&1; times ) | awk 'NR == 2 {
+			u = $1; s = $2; sub(/s$/, "", u); sub(/s$/, "", s)
+			split(u, a, "m"); split(s, b, "m")
+			printf "%.2fs CPU\n", a[1]*60 + a[2] + b[1]*60 + b[2] }'
+	fi
+}
+
+for b in ${GREPCIDR:-./grepcidr} $REF; do
+	echo "$b:"
+	echo "  mail log, -c, 1000 CIDRs	`cost "$b" -c -f "$tmp/list" "$tmp/mail"`"
+	echo "  same, -v			`cost "$b" -v -c -f "$tmp/list" "$tmp/mail"`"
+	echo "  same, -a			`cost "$b" -a -c -f "$tmp/list" "$tmp/mail"`"
+	echo "  random v4 lines, -c		`cost "$b" -c -f "$tmp/list" "$tmp/v4"`"
+done
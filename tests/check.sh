@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Differential check of the address scanner: run grepcidr over generated
+# input with each option that changes which addresses are found, and
+# compare with the switch and isdigit() scanner the byte class table
+# replaced, kept as checksums of its output in tests/expected.
+#
+#	tests/check.sh		check ./grepcidr against tests/expected
+#	REF=old tests/check.sh	check against another build run directly
+#	tests/check.sh -u	rewrite tests/expected, from REF if set
+#
+# GREPCIDR names the build to check, default ./grepcidr.
+
+dir=`dirname "$0"`
+new=${GREPCIDR:-./grepcidr}
+update=0
+[ "$1" = -u ] && update=1
+tmp=${TMPDIR:-/tmp}/grepcidr-check.$$
+trap 'rm -rf "$tmp"' 0
+trap 'exit 2' 1 2 15
+mkdir "$tmp" || exit 2
+
+# fewer than 64 v6 ranges, so -D checks all of them in any version
+"$dir/mkcorpus" fuzz 100000 1 > "$tmp/fuzz" &&
+"$dir/mkcorpus" mail 20000 2 > "$tmp/mail" &&
+"$dir/mkcorpus" v4 20000 3 > "$tmp/v4" &&
+"$dir/mkcorpus" cidr 1000 4 > "$tmp/list" &&
+"$dir/mkcorpus" cidr6 50 5 >> "$tmp/list" || exit 2
+
+# run BIN PATS OPTS INPUT, print the exit status and a checksum of the output
+run() {
+	bin=$1 pats=$2 opts=$3 in=$4
+	case $pats in
+	all)	set -- 0.0.0.0/0,::/0 ;;
+	half)	set -- 0.0.0.0/1,8000::/1 ;;
+	some)	set -- 1.0.0.0/8,10::/16,::/3 ;;
+	list)	set -- -f "$tmp/list" ;;
+	esac
+	[ "$opts" = - ] || set -- $opts "$@"
+	"$bin" "$@" "$tmp/$in" > "$tmp/out" 2>&1
+	echo "$? `cksum < "$tmp/out"`"
+}
+
+fail=0 n=0
+[ $update = 1 ] && : > "$tmp/expected"
+for in in fuzz mail v4; do
+	for pats in all half some list; do
+		for opts in - -v -a -q -C -D -aq -Cq -vD -c -vc; do
+			name="$in $pats $opts"
+			got=`run "$new" $pats $opts $in`
+			if [ $update = 1 ]; then
+				[ -n "$REF" ] && got=`run "$REF" $pats $opts $in`
+				echo "$name $got" >> "$tmp/expected"
+				continue
+			fi
+			if [ -n "$REF" ]; then
+				want=`run "$REF" $pats $opts $in`
+			else
+				want=`grep "^$name " "$dir/expected" | sed "s/^$name //"`
+			fi
+			n=`expr $n + 1`
+			if [ "$got" != "$want" ]; then
+				echo "FAIL: $name: got $got, want $want"
+				fail=1
+			fi
+		done
+	done
+done
+if [ $update = 1 ]; then
+	cp "$tmp/expected" "$dir/expected"
+	echo "Wrote $dir/expected"
+	exit 0
+fi
+[ $fail = 0 ] && echo "All $n cases match"
+exit $fail
@@ -0,0 +1,214 @@
+/*
+ * mkcorpus - write test and benchmark input for grepcidr
+ *
+ * mkcorpus KIND LINES [SEED]
+ *	fuzz	address-like junk: v4, v6, embedded v4, CIDR suffixes,
+ *		bad octets and chunks, stray dots, colons and slashes
+ *	mail	postfix style log lines with one v4 address each
+ *	v4	a v4 address and a word on each line
+ *	cidr	v4 CIDR patterns, /16 to /32
+ *	cidr6	v6 CIDR patterns, /16 to /64
+ *
+ * The generator is self contained, and draws each value in its own
+ * statement since argument order isn't fixed, so the same arguments
+ * give the same bytes everywhere.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long long seed = 1;
+
+/* splitmix64 */
+static unsigned long long
+rnd(void)
+{
+	unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* lo to hi inclusive */
+static unsigned int
+range(unsigned int lo, unsigned int hi)
+{
+	return lo + rnd() % (hi - lo + 1);
+}
+
+static void
+octet(void)
+{
+	int z;
+
+	switch(range(0, 9)) {
+	case 0:
+		printf("%u", range(256, 999));	/* too big */
+		break;
+	case 1:
+		z = range(1, 3);	/* leading zeros */
+		printf("%.*s%u", z, "000", range(0, 255));
+		break;
+	case 2:
+		printf("%u", range(0, 99999));
+		break;
+	default:
+		printf("%u", range(0, 255));
+	}
+}
+
+static void
+quad(int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++) {
+		if(i)
+			putchar('.');
+		octet();
+	}
+}
+
+static void
+chunk(void)
+{
+	static const char hex[] = "0123456789abcdefABCDEF";
+	int i, n;
+
+	if(range(0, 9) < 8) {
+		printf("%x", range(0, 0xffff));
+		return;
+	}
+	for(i = 0, n = range(1, 6); i < n; i++)	/* maybe too long */
+		putchar(hex[range(0, sizeof(hex)-2)]);
+}
+
+static void
+v6(void)
+{
+	int i, n = range(1, 9), gap = range(0, 9) < 5? (int)range(0, n): -1;
+
+	for(i = 0; i < n; i++) {
+		if(i == gap)
+			printf("::");
+		else if(i)
+			putchar(':');
+		chunk();
+	}
+	if(gap == n)
+		printf("::");
+}
+
+static void
+token(void)
+{
+	static const char *junk[] = { "foo", "x1.2.3.4", "abc:def", "1.2.3", "a.b", ":::",
+		"12:34", "deadbeef", "1..2.3.4", "99.3", "", "/", "/24", "/99", ".", ".." };
+	static const char *tail[] = { "/8", "/24", "/64", "/129", ".", "x", ":" };
+	static const char mess[] = "0123456789abcdefxg.:/ ";
+	int i, n;
+
+	switch(range(0, 19)) {
+	case 0: case 1: case 2: case 3: case 4: case 5:
+		quad(4);
+		break;
+	case 6:
+		quad(range(0, 1)? 3: 5);
+		break;
+	case 7: case 8: case 9: case 10:
+		v6();
+		break;
+	case 11:
+		printf("::ffff:");
+		quad(4);
+		break;
+	case 12:
+		quad(4);
+		printf("/%u", range(0, 33));
+		break;
+	case 13:
+		v6();
+		printf("/%u", range(0, 129));
+		break;
+	case 14: case 15: case 16:
+		for(i = 0, n = range(1, 30); i < n; i++)
+			putchar(mess[range(0, sizeof(mess)-2)]);
+		break;
+	default:
+		fputs(junk[range(0, sizeof(junk)/sizeof(junk[0])-1)], stdout);
+	}
+	if(range(0, 4) == 0)
+		fputs(tail[range(0, sizeof(tail)/sizeof(tail[0])-1)], stdout);
+}
+
+static void
+fuzz(void)
+{
+	static const char *sep[] = { " ", "", ",", "\t" };
+	const char *s = sep[range(0, 3)];
+	int i, n = range(0, 5);
+
+	if(range(0, 3) == 0)
+		putchar(' ');
+	for(i = 0; i < n; i++) {
+		if(i)
+			fputs(s, stdout);
+		token();
+	}
+	putchar('\n');
+}
+
+static void
+addr4(void)
+{
+	unsigned int a = (unsigned int)rnd();
+
+	printf("%u.%u.%u.%u", a >> 24, (a >> 16) & 255, (a >> 8) & 255, a & 255);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int len4[] = { 16, 20, 24, 28, 32 }, len6[] = { 16, 32, 48, 64 };
+	unsigned long i, lines;
+	const char *kind;
+
+	if(argc < 3) {
+		fprintf(stderr, "Usage: mkcorpus fuzz|mail|v4|cidr|cidr6 LINES [SEED]\n");
+		return 2;
+	}
+	kind = argv[1];
+	lines = strtoul(argv[2], NULL, 10);
+	if(argc > 3)
+		seed = strtoull(argv[3], NULL, 10);
+	for(i = 0; i < lines; i++) {
+		if(!strcmp(kind, "fuzz"))
+			fuzz();
+		else if(!strcmp(kind, "mail")) {
+			printf("Oct 18 mail postfix/smtpd[%u]: connect from unknown[", range(1000, 99999));
+			addr4();
+			printf("] helo=abc.example.com deadbeef\n");
+		} else if(!strcmp(kind, "v4")) {
+			addr4();
+			printf(" x\n");
+		} else if(!strcmp(kind, "cidr")) {
+			int l = len4[range(0, 4)];
+			unsigned int a = (unsigned int)rnd() & ~0U << (32 - l);
+
+			printf("%u.%u.%u.%u/%d\n", a >> 24, (a >> 16) & 255, (a >> 8) & 255, a & 255, l);
+		} else if(!strcmp(kind, "cidr6")) {
+			int l = len6[range(0, 3)], k;
+
+			printf("%x", range(0x2000, 0x3fff));
+			for(k = 16; k < l; k += 16)
+				printf(":%x", range(0, 0xffff));
+			printf("::/%d\n", l);
+		} else {
+			fprintf(stderr, "Unknown kind: %s\n", kind);
+			return 2;
+		}
+	}
+	return 0;
+}